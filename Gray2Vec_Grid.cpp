@@ -106,13 +106,165 @@
 
 #include <cmath>
 #include <cstdlib>
+#include <algorithm>
+#include <cstring>
+#include <cstddef>
+#include <climits>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "Gray2Vec_Grid.h"
 
+// number of reduced grid lines processed beyond the shard boundaries so
+// the results there are close to those of processing the whole image.
+// This is a heuristic and not a bound: the steps updating the pixels in
+// place can carry a change over any number of lines, in practice the
+// effect of the lines further away is rarely noticeable
+static const int ShardOverlap = 128;
+
+// size of the blocks of the block index (see Gray2Vec_Grid::m_block_min)
+static const int BlockSize = 64;
+
+// lines per chunk of the work distributed among the threads (see Gray2Vec_Pool)
+static const int PoolLines = 8;
+
+#ifdef __SSE2__
+/// sums of 8 quads of 2x2 pixels from two full resolution lines as 16 bit values
+static inline __m128i quad_sums8(const unsigned char *r0, const unsigned char *r1)
+{
+	const __m128i mask = _mm_set1_epi16(0x00ff);
+	const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(r0));
+	const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(r1));
+	return _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a, mask), _mm_srli_epi16(a, 8)),
+	                     _mm_add_epi16(_mm_and_si128(b, mask), _mm_srli_epi16(b, 8)));
+}
+
+/// bytes of a where mask m is set, of b otherwise
+static inline __m128i select_epi8(const __m128i m, const __m128i a, const __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+#endif
+
+/// sums of the w quads of 2x2 pixels of the full resolution lines r0 and r1
+static void quad_sums(const unsigned char *r0, const unsigned char *r1, unsigned short *sum, const int w)
+{
+	int x = 0;
+
+#ifdef __SSE2__
+	for (; x+8 <= w; x += 8)
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(sum+x), quad_sums8(r0+x*2, r1+x*2));
+#endif
+
+	for (; x < w; x++)
+		sum[x] = r0[x*2]+r0[x*2+1]+r1[x*2]+r1[x*2+1];
+}
+
+/// averages of the w quads of 2x2 pixels of the full resolution lines r0 and r1,
+/// rounded down like the conversion of 0.25*sum to an integer
+static void quad_averages(const unsigned char *r0, const unsigned char *r1, unsigned char *avg, const int w)
+{
+	int x = 0;
+
+#ifdef __SSE2__
+	for (; x+16 <= w; x += 16)
+	{
+		const __m128i lo = _mm_srli_epi16(quad_sums8(r0+x*2, r1+x*2), 2);
+		const __m128i hi = _mm_srli_epi16(quad_sums8(r0+x*2+16, r1+x*2+16), 2);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(avg+x), _mm_packus_epi16(lo, hi));
+	}
+#endif
+
+	for (; x < w; x++)
+		avg[x] = (r0[x*2]+r0[x*2+1]+r1[x*2]+r1[x*2+1]) >> 2;
+}
+
+/// values of partial pixels that - in combination with the rest of the combined
+/// data - approximate the target background value, indexed by the average of
+/// the combined image and the pixel value.  They are evaluated with the original
+/// floating point formula once so the results do not change with the rounding.
+struct Gray2Vec_CombineTable
+{
+	Gray2Vec_CombineTable()
+	{
+		for (int fc = 0; fc < 256; fc++)
+			for (int s = 0; s < 256; s++)
+			{
+				v[fc][s] = s;
+				if ((s != 0) && (s != 255) && (fc > s))
+					v[fc][s] = 255*(1.0 - (1.0-fc/255.0)/(1.0-(fc-s)/255.0));
+			}
+	}
+
+	unsigned char v[256][256];
+};
+
+static const Gray2Vec_CombineTable CombineTable;
 
-bool Gray2Vec_Grid::check_cover(int n, int d)
+/// neighbourhood codes assigned by the analysis depending on the
+/// pixel value and the quad summary (see Gray2Vec_Grid::m_img_q)
+struct Gray2Vec_AnalyzeTable
 {
-	int n2;
+	Gray2Vec_AnalyzeTable()
+	{
+		for (int s = 0; s < 256; s++)
+		{
+			if (s == 0) range[s] = 0;
+			else if (s == 255) range[s] = 4;
+			else if (s < 255/3) range[s] = 1;
+			else if (s > 2*255/3) range[s] = 2;
+			else range[s] = 3;
+		}
+
+		for (int q = 0; q < 256; q++)
+		{
+			unsigned char code[5];
+			code[0] = 0;
+			// small fractions: use highest value corner
+			code[1] = q & 15;
+			// big fractions: use highest value corner
+			code[2] = (q & 15) + 10;
+			// medium fractions: use highest value side
+			code[3] = q >> 4;
+			code[4] = 255;
+
+			for (int r = 0; r < 5; r++)
+				state[r][q] = Gray2Vec_CodeState.state[code[r]];
+		}
+	}
+
+	/// range of pixel values: empty, small, big and medium fractions, full
+	unsigned char range[256];
+	/// 4 bit states of the codes (see Gray2Vec_CodePlane)
+	unsigned char state[5][256];
+};
+
+static const Gray2Vec_AnalyzeTable AnalyzeTable;
+
+/// combine the w pixels s with the sums of the 2x2 pixels of the combined image
+static void combine_row(const unsigned short *sum, unsigned char *s, const int w, const bool complement)
+{
+	for (int x = 0; x < w; x++)
+	{
+		// same as converting 0.25*sum - s to unsigned char
+		if (complement)
+			s[x] = (sum[x] - 4*s[x])/4;
+
+		s[x] = CombineTable.v[sum[x] >> 2][s[x]];
+	}
+}
+
+/// check if neighbourhood n covers direction d (used for generating CoverTable)
+static constexpr bool cover(int n, const int d)
+{
+	int n2 = 0;
 
 	if (n == 0) return false;
 	if (n == 255) return true;
@@ -159,8 +311,215 @@ bool Gray2Vec_Grid::check_cover(int n, int d)
 	}
 }
 
-Gray2Vec_Grid::Gray2Vec_Grid(const std::string file, const std::string file_c, const bool Complement, const bool Debug)
-	: m_debug(Debug)
+/// directions covered by every neighbourhood code as bit mask
+/// (bit d set if check_cover() is true for direction d)
+struct Gray2Vec_CoverTable
+{
+	unsigned short mask[256];
+};
+
+static constexpr Gray2Vec_CoverTable make_cover_table()
+{
+	Gray2Vec_CoverTable Table = {};
+	for (int n = 0; n < 256; n++)
+		for (int d = 1; d <= 8; d++)
+			if (cover(n, d)) Table.mask[n] |= 1 << d;
+	return Table;
+}
+
+static constexpr Gray2Vec_CoverTable CoverTable = make_cover_table();
+
+inline bool Gray2Vec_Grid::check_cover(int n, int d)
+{
+	return (CoverTable.mask[n] >> d) & 1;
+}
+
+/// first side the edge of neighbourhood n runs to (used for generating StateTable)
+static constexpr int edge_side1(const int n)
+{
+	switch (n)
+	{
+		case 1: return 2;
+		case 2: return 4;
+		case 3: return 4;
+		case 4: return 6;
+		case 5: return 6;
+		case 6: return 8;
+		case 7: return 8;
+		case 8: return 2;
+		case 11: return 4;
+		case 13: return 6;
+		case 15: return 8;
+		case 17: return 2;
+	}
+	return 0;
+}
+
+/// second side the edge of neighbourhood n runs to (used for generating StateTable)
+static constexpr int edge_side2(const int n)
+{
+	switch (n)
+	{
+		case 1: return 8;
+		case 2: return 8;
+		case 3: return 2;
+		case 4: return 2;
+		case 5: return 4;
+		case 6: return 4;
+		case 7: return 6;
+		case 8: return 6;
+		case 11: return 6;
+		case 13: return 8;
+		case 15: return 2;
+		case 17: return 4;
+	}
+	return 0;
+}
+
+/// sides of a pixel (and the neighbours at these sides)
+static const int NbN = 0;
+static const int NbE = 1;
+static const int NbS = 2;
+static const int NbW = 3;
+
+/// fraction giving the position of the edge of neighbourhood n where it
+/// crosses side nb (used for generating StateTable, see Gray2Vec_StateTable::edge)
+static constexpr int edge_fraction(const int n, const int nb)
+{
+	switch (nb)
+	{
+		case NbN:
+			if ((n == 17) || (n == 8) || (n == 1)) return 1;
+			if ((n == 3) || (n == 4) || (n == 15)) return -2;
+			break;
+		case NbE:
+			if ((n == 11) || (n == 2) || (n == 3)) return 1;
+			if ((n == 5) || (n == 6) || (n == 17)) return -2;
+			break;
+		case NbS:
+			if ((n == 7) || (n == 8) || (n == 11)) return 2;
+			if ((n == 13) || (n == 4) || (n == 5)) return -1;
+			break;
+		case NbW:
+			if ((n == 1) || (n == 2) || (n == 13)) return 2;
+			if ((n == 15) || (n == 6) || (n == 7)) return -1;
+			break;
+	}
+	return 0;
+}
+
+/// subpixels of the 2x2 pattern of the subgrid covered by neighbourhood n:
+/// 1 2
+/// 4 8
+static constexpr int subgrid_pattern(const int n)
+{
+	switch (n)
+	{
+		case 1: return 1;
+		case 2: return 1+2;
+		case 3: return 2;
+		case 4: return 2+8;
+		case 5: return 8;
+		case 6: return 4+8;
+		case 7: return 4;
+		case 8: return 1+4;
+		case 11: return 1+2+4;
+		case 13: return 1+2+8;
+		case 15: return 2+4+8;
+		case 17: return 1+4+8;
+		case 255: return 1+2+4+8;
+	}
+	return 0;
+}
+
+/// properties of the neighbourhood codes indexed by their 4 bit state
+/// (see Gray2Vec_CodePlane)
+struct Gray2Vec_StateTable
+{
+	/// directions covered as bit mask (see Gray2Vec_CoverTable)
+	unsigned short cover[16];
+	/// sides the edge runs to (see Gray2Vec_Grid::side1(), Gray2Vec_Grid::side2())
+	unsigned char side1[16];
+	unsigned char side2[16];
+	/// position of the edge at the sides NbN, NbE, NbS and NbW: 1/2 for f1/f2,
+	/// -1/-2 for 255-f1/255-f2, 0 if the edge does not cross the side
+	signed char edge[16][4];
+	/// covered subpixels of the subgrid (see subgrid_pattern())
+	unsigned char subgrid[16];
+};
+
+static constexpr Gray2Vec_StateTable make_state_table()
+{
+	Gray2Vec_StateTable Table = {};
+	for (int st = 0; st < 16; st++)
+	{
+		const int n = Gray2Vec_StateCode[st];
+		Table.cover[st] = CoverTable.mask[n];
+		Table.side1[st] = edge_side1(n);
+		Table.side2[st] = edge_side2(n);
+		for (int nb = 0; nb < 4; nb++)
+			Table.edge[st][nb] = edge_fraction(n, nb);
+		Table.subgrid[st] = subgrid_pattern(n);
+	}
+	return Table;
+}
+
+static constexpr Gray2Vec_StateTable StateTable = make_state_table();
+
+/// pixel offsets of the directions 0 (none) and 1-8 (see check_cover())
+static const int DirX[9] = { 0, -1, 0, 1, 1, 1, 0, -1, -1 };
+static const int DirY[9] = { 0, -1, -1, -1, 0, 1, 1, 1, 0 };
+
+/// position of the edge of cell c where it crosses side nb as fraction
+/// of the side (0-255) or -1 if it does not cross it
+static double cell_edge(const Gray2Vec_Cell &c, const int nb)
+{
+	switch (StateTable.edge[Gray2Vec_CodeState.state[c.n]][nb])
+	{
+		case 1: return c.f1;
+		case 2: return c.f2;
+		case -1: return 255-c.f1;
+		case -2: return 255-c.f2;
+	}
+	return -1.0;
+}
+
+int Gray2Vec_Grid::step_reach(const Gray2Vec_StepType type)
+{
+	switch (type)
+	{
+		case G2V_ANALYZE:
+		case G2V_INIT_FRACTIONS:
+			return 0;
+			break;
+		default:
+			return 1;
+			break;
+	}
+	return 1;
+}
+
+bool Gray2Vec_Grid::step_parallel(const Gray2Vec_StepType type)
+{
+	// the neighbor adjustments modify the pixel classes in place
+	// so the result depends on the processing order
+	switch (type)
+	{
+		case G2V_ANALYZE:
+		case G2V_INIT_FRACTIONS:
+		case G2V_FRACTIONS_NEIGHBORS:
+		case G2V_TUNE_FRACTIONS:
+			return true;
+			break;
+		default:
+			return false;
+			break;
+	}
+	return false;
+}
+
+Gray2Vec_Grid::Gray2Vec_Grid(const std::string file, const std::string file_c, const bool Complement, const bool Debug, const int Window, const int Shard, const int Shards)
+	: m_debug(Debug), m_complement(Complement), m_dual(false), m_interleave(false), m_checkerboard(false), m_window(Window), m_shard(Shard), m_shards(Shards)
 {
 	GDALAllRegister();
 	OGRRegisterAll();
@@ -169,43 +528,101 @@ Gray2Vec_Grid::Gray2Vec_Grid(const std::string file, const std::string file_c, c
 	m_y = -1;
 	m_z = -1;
 
-	std::fprintf(stderr,"Loading image data...\n");
+	m_threads = 1;
+	m_pool = new Gray2Vec_Pool(m_threads);
+
+	m_resume = false;
+
+	m_poDataset = NULL;
+	m_poDataset2 = NULL;
+	m_poBand2 = NULL;
+	m_band = 1;
+	m_SRS = NULL;
+
+	m_width = 0;
+	m_height = 0;
+	m_row0 = 0;
+	m_blocks_x = 0;
 
-	GDALDataset  *poDataset;
+	m_spool = NULL;
+	m_reader = NULL;
 
-	poDataset = static_cast<GDALDataset *>(GDALOpen( file.c_str(), GA_ReadOnly ));
+	if (m_window < 0) m_window = 0;
 
-	if (poDataset == NULL)
+	Open(file, file_c);
+}
+
+void Gray2Vec_Grid::Open(const std::string file, const std::string file_c)
+{
+	if (m_poDataset2 != NULL) GDALClose(m_poDataset2);
+	if (m_poDataset != NULL) GDALClose(m_poDataset);
+	if (m_SRS != NULL) OSRDestroySpatialReference(m_SRS);
+
+	// the combined image data read so far can be used for the new input
+	// if it covers the same part of the same combined image
+	const bool KeepCombined = (file_c == m_file_c) && (m_band == 1);
+	const int nWidth = m_width;
+	const int nHeight = m_height;
+	const int nRow0 = m_row0;
+
+	m_file = file;
+	m_file_c = file_c;
+	m_poDataset2 = NULL;
+	m_poBand2 = NULL;
+	m_band = 1;
+
+	std::fprintf(stderr,"Loading image data...\n");
+
+	m_poDataset = static_cast<GDALDataset *>(GDALOpen( file.c_str(), GA_ReadOnly ));
+
+	if (m_poDataset == NULL)
 	{
 		std::fprintf(stderr,"  opening file %s failed.\n\n", file.c_str());
 		std::exit(1);
 	}
 
-	if (poDataset->GetGeoTransform( m_GeoTransform ) != CE_None)
+	if (m_poDataset->GetGeoTransform( m_GeoTransform ) != CE_None)
 	{
 		std::fprintf(stderr,"  error reading coordinates from file %s.\n\n", file.c_str());
 		std::exit(1);
 	}
 
-	m_SRS = OSRNewSpatialReference( poDataset->GetProjectionRef() );
-
-	GDALRasterBand  *poBand;
-	poBand = poDataset->GetRasterBand(1);
+	m_SRS = OSRNewSpatialReference( m_poDataset->GetProjectionRef() );
 
-	int nXSize = poBand->GetXSize();
-	int nYSize = poBand->GetYSize();
+	m_poBand = m_poDataset->GetRasterBand(1);
 
-	m_img = CImg<unsigned char>(nXSize, nYSize, 1, 1);
+	int nXSize = m_poBand->GetXSize();
+	int nYSize = m_poBand->GetYSize();
 
-	if (poBand->RasterIO(GF_Read, 0, 0, nXSize, nYSize, m_img.data(), nXSize, nYSize, GDT_Byte, 0, 0) != CE_None)
-	{
-		std::fprintf(stderr,"  error reading image data from file %s.\n\n", file.c_str());
-		std::exit(1);
-	}
+	m_width = nXSize/2;
+	m_height = nYSize/2;
 
 	std::fprintf(stderr,"input image: %s:\n", file.c_str());
 	std::fprintf(stderr,"  %d x %d pixel\n", nXSize, nYSize);
-	std::fprintf(stderr,"  (%d x %d pixel reduced)\n", m_img.width()/2, m_img.height()/2);
+	std::fprintf(stderr,"  (%d x %d pixel reduced)\n", m_width, m_height);
+
+	m_row0 = 0;
+	m_out0 = 0;
+	m_out1 = m_height;
+
+	if (m_shards > 1)
+	{
+		if ((m_shard < 0) || (m_shard >= m_shards) || (m_shards > m_height))
+		{
+			std::fprintf(stderr,"  invalid shard %d/%d for image with %d reduced lines.\n\n", m_shard, m_shards, m_height);
+			std::exit(1);
+		}
+
+		const int y0 = (size_t(m_height)*m_shard)/m_shards;
+		const int y1 = (size_t(m_height)*(m_shard+1))/m_shards;
+
+		m_row0 = std::max(0, y0-ShardOverlap);
+		m_out0 = y0-m_row0;
+		m_out1 = y1-m_row0;
+		m_height = std::min(m_height, y1+ShardOverlap) - m_row0;
+
+		std::fprintf(stderr,"  shard %d of %d: reduced lines %d to %d (processing %d to %d)\n", m_shard, m_shards, y0, y1-1, m_row0, m_row0+m_height-1);
+	}
 	
 	if (m_debug)
 	{
@@ -224,348 +641,1721 @@ Gray2Vec_Grid::Gray2Vec_Grid(const std::string file, const std::string file_c, c
 		std::fprintf(stderr," corner 4: %f/%f\n", cx, cy);
 	}
 
-	m_img_n = CImg<unsigned char>(m_img.width()/2, m_img.height()/2, 1, 1);
-	m_img_s = CImg<unsigned char>(m_img.width()/2, m_img.height()/2, 1, 1);
+	if (!file_c.empty())
+	{
+		m_poDataset2 = static_cast<GDALDataset *>(GDALOpen( file_c.c_str(), GA_ReadOnly ));
+
+		if (m_poDataset2 == NULL)
+		{
+			std::fprintf(stderr,"  opening file %s failed.\n\n", file_c.c_str());
+			std::exit(1);
+		}
+
+		m_poBand2 = m_poDataset2->GetRasterBand(1);
+
+		if ((m_poBand2->GetXSize() != nXSize) || (m_poBand2->GetYSize() != nYSize))
+		{
+			std::fprintf(stderr,"  combined image %s does not match size of input image.\n\n", file_c.c_str());
+			std::exit(1);
+		}
+	}
+
+	// in streaming mode data is read while processing
+	if (m_window > 0)
+		std::fprintf(stderr,"  streaming mode, processing %d lines at a time\n", m_window);
+
+	if (!KeepCombined || (m_width != nWidth) || (m_height != nHeight) || (m_row0 != nRow0))
+	{
+		m_img_c.clear();
+		m_tiles_c.clear();
+	}
+
+	Reset();
+}
+
+Gray2Vec_Grid::~Gray2Vec_Grid()
+{
+	delete m_reader;
+	delete m_pool;
+
+	if (m_spool != NULL)
+	{
+		VSIFCloseL(m_spool);
+		VSIUnlink(m_spool_file.c_str());
+	}
+
+	if (m_poDataset2 != NULL) GDALClose(m_poDataset2);
+	if (m_poDataset != NULL) GDALClose(m_poDataset);
+	if (m_SRS != NULL) OSRDestroySpatialReference(m_SRS);
+}
+
+void Gray2Vec_Grid::SetThreads(const int Threads)
+{
+	m_threads = std::max(Threads, 1);
+
+	delete m_pool;
+	m_pool = new Gray2Vec_Pool(m_threads);
+}
+
+void Gray2Vec_Grid::SelectBand(const int Band)
+{
+	if ((Band < 1) || (Band > m_poDataset->GetRasterCount()))
+	{
+		std::fprintf(stderr,"  input image %s has no band %d.\n\n", m_file.c_str(), Band);
+		std::exit(1);
+	}
+
+	m_band = Band;
+	m_poBand = m_poDataset->GetRasterBand(Band);
+
+	// the combined image can either have matching bands or a single one for all
+	if (m_poDataset2 != NULL)
+	{
+		GDALRasterBand *poBand2 = m_poDataset2->GetRasterBand((Band <= m_poDataset2->GetRasterCount()) ? Band : 1);
+
+		if (poBand2 != m_poBand2)
+		{
+			m_img_c.clear();
+			m_tiles_c.clear();
+		}
+
+		m_poBand2 = poBand2;
+	}
+
+	std::fprintf(stderr,"Processing band %d of %d...\n", Band, m_poDataset->GetRasterCount());
+
+	Reset();
+}
+
+void Gray2Vec_Grid::Complement()
+{
+	if (!m_dual || (m_window > 0) || (m_poBand2 == NULL) || !m_loaded || (m_img_so.width() == 0))
+	{
+		std::fprintf(stderr,"  processing the complement requires the data of the combined image to be kept.\n\n");
+		std::exit(1);
+	}
+
+	std::fprintf(stderr,"Processing complement...\n");
+
+	m_complement = !m_complement;
+	m_fractions = false;
+
+	Deinterleave();
+
+	// the averages and quad summaries of the input are reused,
+	// only the combination with the combined image is repeated
+	std::memcpy(m_img_s.row(0), m_img_so.row(0), size_t(m_width)*m_height);
+
+	CombineRows(0, m_height);
+	IndexRows(0, m_height);
+}
+
+void Gray2Vec_Grid::Reset()
+{
+	m_loaded = false;
+	m_fractions = false;
+	m_processed = false;
+
+	m_img_so.clear();
+	Deinterleave();
+
+	if (m_spool != NULL)
+	{
+		VSIFCloseL(m_spool);
+		VSIUnlink(m_spool_file.c_str());
+		m_spool = NULL;
+	}
+}
+
+void Gray2Vec_Grid::Interleave()
+{
+	if (!m_records.empty() || (m_window > 0) || (size_t(m_width)*m_height == 0)) return;
+
+	m_records.resize(size_t(m_width)*m_height);
+
+	unsigned char *data = reinterpret_cast<unsigned char *>(&m_records[0]);
+	const size_t pitch = sizeof(Gray2Vec_Record);
+
+	m_img_s.share(data + offsetof(Gray2Vec_Record, s), pitch);
+	m_img_n.share(data + offsetof(Gray2Vec_Record, n), pitch);
+	m_img_f1.share(data + offsetof(Gray2Vec_Record, f1), pitch);
+	m_img_f2.share(data + offsetof(Gray2Vec_Record, f2), pitch);
+	m_img_f3.share(data + offsetof(Gray2Vec_Record, f3), pitch);
+}
+
+void Gray2Vec_Grid::Deinterleave()
+{
+	if (m_records.empty()) return;
+
+	m_img_s.unshare();
+	m_img_n.unshare();
+	m_img_f1.unshare();
+	m_img_f2.unshare();
+	m_img_f3.unshare();
+
+	std::vector<Gray2Vec_Record>().swap(m_records);
+}
+
+void Gray2Vec_Grid::SetScratch(const std::string dir)
+{
+	m_img_c.set_scratch(dir);
+	m_img_q.set_scratch(dir);
+	m_img_s.set_scratch(dir);
+	m_img_n.set_scratch(dir);
+	m_img_f1.set_scratch(dir);
+	m_img_f2.set_scratch(dir);
+	m_img_f3.set_scratch(dir);
+	m_img_e.set_scratch(dir);
+	m_img_so.set_scratch(dir);
+}
+
+void Gray2Vec_Grid::Load()
+{
+	if (m_loaded) return;
+
+	m_loaded = true;
+
+	// in streaming mode data is read while processing
+	if (m_window > 0) return;
+
+	m_img_q.assign(m_width, m_height);
+	m_img_n.assign(m_width, m_height);
+	m_img_s.assign(m_width, m_height);
 
 	std::fprintf(stderr,"Averaging values...\n");
 
-	cimg_forXY(m_img_s,px,py)
+	// the lines are averaged in blocks while the following ones are read
+	m_reader = new Gray2Vec_Reader(m_file, m_band, m_row0*2, (m_row0+m_height)*2, m_threads);
+
+	for (int py = 0; py < m_height; py += 32)
+		ReadRows(py, std::min(m_height, py+32));
+
+	delete m_reader;
+	m_reader = NULL;
+
+	if (m_poBand2 != NULL)
+	{
+		if (m_debug)  m_img_s.image().save("debug-so.tif");
+
+		// the averages are modified by the combination and are needed again for the complement
+		if (m_dual)
+		{
+			m_img_so.assign(m_width, m_height);
+			std::memcpy(m_img_so.row(0), m_img_s.row(0), size_t(m_width)*m_height);
+		}
+
+		std::fprintf(stderr,"Loading combined image data...\n");
+		std::fprintf(stderr,"Processing partical pixels...\n");
+
+		CombineRows(0, m_height);
+	}
+
+	IndexRows(0, m_height);
+}
+
+void Gray2Vec_Grid::LoadRows(const int y0, const int y1)
+{
+	ReadRows(y0, y1);
+	CombineRows(y0, y1);
+	IndexRows(y0, y1);
+}
+
+void Gray2Vec_Grid::ReadRows(const int y0, const int y1)
+{
+	int nXSize = m_poBand->GetXSize();
+
+	if (y1 <= y0) return;
+
+	// the full resolution data is only kept while loading
+	CImg<unsigned char> img = CImg<unsigned char>(nXSize, (y1-y0)*2, 1, 1);
+
+	if (!m_reader->Read(img.data(), (m_row0+y0)*2, (m_row0+y1)*2))
+	{
+		std::fprintf(stderr,"  error reading image data from file %s.\n\n", m_file.c_str());
+		std::exit(1);
+	}
+
+	m_pool->Run(y1-y0, PoolLines, std::bind(&Gray2Vec_Grid::AverageRows, this, &img, y0, std::placeholders::_1, std::placeholders::_2));
+}
+
+void Gray2Vec_Grid::AverageRows(CImg<unsigned char> *img, const int y0, const int c0, const int c1)
+{
+	for (int cy = c0; cy < c1; cy++)
 	{
-		m_img_s(px,py) = 0.25*(m_img(px*2,py*2)+m_img(px*2+1,py*2)+m_img(px*2,py*2+1)+m_img(px*2+1,py*2+1));
+		// lines of img start at y0
+		const int py = y0+cy;
+
+		quad_averages(img->data(0,cy*2), img->data(0,cy*2+1), m_img_s.row(py), m_width);
+
+		quad_summary_row(img->data(0,cy*2), img->data(0,cy*2+1), m_img_q.row(py), m_width);
 	}
+}
+
+void Gray2Vec_Grid::CombineRows(const int y0, const int y1)
+{
+	if ((m_poBand2 != NULL) && (y1 > y0))
+	{
+		// the combined image is read in tiles matching its blocks, without
+		// complement only tiles containing partial pixels are needed
+		int nBlockX, nBlockY;
+		m_poBand2->GetBlockSize(&nBlockX, &nBlockY);
+
+		const int tw = std::max(1, nBlockX/2);
+		const int th = std::max(1, nBlockY/2);
+
+		CImg<unsigned char> img_c = CImg<unsigned char>(tw*2, th*2, 1, 1);
+		// sums of the 2x2 full resolution pixels of the tile
+		CImg<unsigned short> sum_c = CImg<unsigned short>(tw, th, 1, 1);
+
+		// when loading the whole image the sums are kept for processing
+		// further inputs with the same combined image (see Open())
+		const bool Cache = (m_window == 0);
+
+		if (Cache && (m_img_c.width() == 0))
+		{
+			m_img_c.assign(m_width, m_height);
+			m_tiles_c.assign(size_t((m_width+tw-1)/tw)*((m_row0+m_height-1)/th - m_row0/th + 1), false);
+		}
+
+		// tiles are aligned to the blocks in the whole image
+		for (int ty = ((m_row0+y0)/th)*th - m_row0; ty < y1; ty += th)
+			for (int tx = 0; tx < m_width; tx += tw)
+			{
+				const int ty0 = std::max(ty, y0);
+				const int ty1 = std::min(ty+th, y1);
+				const int tx1 = std::min(tx+tw, m_width);
+
+				bool Partial = m_complement;
+
+				for (int py = ty0; !Partial && (py < ty1); py++)
+					for (int px = tx; px < tx1; px++)
+						if ((m_img_s(px,py) != 0) && (m_img_s(px,py) != 255))
+						{
+							Partial = true;
+							break;
+						}
+
+				if (!Partial) continue;
+
+				const size_t nTile = size_t((m_row0+ty)/th - m_row0/th)*((m_width+tw-1)/tw) + tx/tw;
+
+				if (Cache && m_tiles_c[nTile])
+				{
+					for (int py = ty0; py < ty1; py++)
+						std::memcpy(sum_c.data(0,py-ty0), m_img_c.row(py)+tx, (tx1-tx)*sizeof(unsigned short));
+				}
+				else
+				{
+					if (m_poBand2->RasterIO(GF_Read, tx*2, (m_row0+ty0)*2, (tx1-tx)*2, (ty1-ty0)*2, img_c.data(), (tx1-tx)*2, (ty1-ty0)*2, GDT_Byte, 0, img_c.width()) != CE_None)
+					{
+						std::fprintf(stderr,"  error reading image data from file %s.\n\n", m_file_c.c_str());
+						std::exit(1);
+					}
+
+					// img_c and sum_c hold the tile starting at tx/ty0
+					for (int cy = 0; cy < ty1-ty0; cy++)
+					{
+						quad_sums(img_c.data(0,cy*2), img_c.data(0,cy*2+1), sum_c.data(0,cy), tx1-tx);
+						if (Cache) std::memcpy(m_img_c.row(ty0+cy)+tx, sum_c.data(0,cy), (tx1-tx)*sizeof(unsigned short));
+					}
+
+					if (Cache) m_tiles_c[nTile] = true;
+				}
+
+				// partial pixels are set to a value that - in combination with the rest
+				// of the combined data approximate the target background value to avoid 
+				// the background shining through with AGG type renderers
+				for (int py = ty0; py < ty1; py++)
+					combine_row(sum_c.data(0,py-ty0), m_img_s.row(py)+tx, tx1-tx, m_complement);
+			}
+	}
+}
+
+void Gray2Vec_Grid::IndexRows(const int y0, const int y1)
+{
+	if (y0 == 0)
+	{
+		// blocks without any lines yet are neither empty nor full
+		m_blocks_x = (m_width+BlockSize-1)/BlockSize;
+		m_block_min.assign(size_t(m_blocks_x)*((m_height+BlockSize-1)/BlockSize), 255);
+		m_block_max.assign(m_block_min.size(), 0);
+	}
+
+	for (int py = y0; py < y1; py++)
+	{
+		const unsigned char *s = m_img_s.row(py);
+		const size_t nBlock = size_t(py/BlockSize)*m_blocks_x;
+
+		for (int bx = 0; bx < m_blocks_x; bx++)
+		{
+			const int px1 = std::min(m_width, (bx+1)*BlockSize);
+			unsigned char vmin = m_block_min[nBlock+bx];
+			unsigned char vmax = m_block_max[nBlock+bx];
+
+			for (int px = bx*BlockSize; px < px1; px++)
+			{
+				vmin = std::min(vmin, s[px]);
+				vmax = std::max(vmax, s[px]);
+			}
+
+			m_block_min[nBlock+bx] = vmin;
+			m_block_max[nBlock+bx] = vmax;
+		}
+	}
+}
+
+bool Gray2Vec_Grid::block_uniform(const int bx, const int by) const
+{
+	const size_t nBlock = size_t(by)*m_blocks_x + bx;
+
+	return (m_block_min[nBlock] == m_block_max[nBlock]) && ((m_block_min[nBlock] == 0) || (m_block_min[nBlock] == 255));
+}
+
+void Gray2Vec_Grid::StandardSchedule(std::vector<Gray2Vec_Step> &Steps, const double max_error, const int Rounds)
+{
+	Steps.clear();
+
+	Steps.push_back(Gray2Vec_Step(G2V_ANALYZE));
+	Steps.push_back(Gray2Vec_Step(G2V_OPTIMIZE_SIDES));
+	Steps.push_back(Gray2Vec_Step(G2V_SMOOTH_EDGES));
+	Steps.push_back(Gray2Vec_Step(G2V_RESOLVE_CONFLICTS1));
+	Steps.push_back(Gray2Vec_Step(G2V_RESOLVE_CONFLICTS2));
+	Steps.back().checkpoint = true;
+	Steps.push_back(Gray2Vec_Step(G2V_INIT_FRACTIONS));
+
+	Steps.push_back(Gray2Vec_Step(G2V_FRACTIONS_NEIGHBORS));
+	Steps.push_back(Gray2Vec_Step(G2V_TUNE_FRACTIONS));
+	Steps.back().loop = 2;
+	Steps.back().rounds = (Rounds > 0) ? Rounds : 6;
+	Steps.back().checkpoint = true;
+
+	for (int j = 0; j < 2; j++)
+	{
+		Steps.push_back(Gray2Vec_Step(G2V_ADJUST_TYPES));
+		Steps.push_back(Gray2Vec_Step(G2V_RESOLVE_CONFLICTS1));
+		Steps.push_back(Gray2Vec_Step(G2V_RESOLVE_CONFLICTS2));
+
+		Steps.push_back(Gray2Vec_Step(G2V_FRACTIONS_NEIGHBORS));
+		Steps.push_back(Gray2Vec_Step(G2V_TUNE_FRACTIONS));
+		Steps.back().loop = 2;
+		Steps.back().rounds = (Rounds > 0) ? Rounds : 3;
+		Steps.back().checkpoint = true;
+	}
+
+	Steps.push_back(Gray2Vec_Step(G2V_FRACTIONS_NEIGHBORS));
+	Steps.push_back(Gray2Vec_Step(G2V_TUNE_FRACTIONS, max_error));
+	Steps.back().checkpoint = true;
+}
+
+/// pixels per span of a line in the worklist
+static const int WorkSpan = 256;
+
+/// worklist for the rounds of a repeated phase of fraction steps (see
+/// Gray2Vec_Step::loop): the lines are divided into spans, after the first
+/// round a step only processes the spans with fractions changed since it was
+/// last run and uses the statistics from then for the others.  The fraction
+/// steps read nothing but the fractions of the pairs or pixels they modify
+/// (and data not changing during the phase) so the result is the same.
+struct Gray2Vec_Worklist
+{
+	/// start a phase with Loop steps per round
+	void begin(const int Loop, const int Width, const int Height)
+	{
+		spans = (Width+WorkSpan-1)/WorkSpan;
+		width = Width;
+		height = Height;
+		changed.assign(size_t(spans)*height, 0);
+		last.assign(Loop, 0);
+		stats.resize(Loop);
+		for (int i = 0; i < Loop; i++)
+			stats[i].assign(size_t(spans)*height, Gray2Vec_Stats());
+	}
+
+	/// if span j of line py has to be processed by the current step
+	bool dirty(const Gray2Vec_StepType type, const int py, const int j) const
+	{
+		const int l = last[pos];
+		if (l == 0) return true;
+		const size_t i = size_t(py)*spans + j;
+		if (changed[i] >= l) return true;
+		// the neighbor adjustment also modifies the pixels right of and below the span
+		if (type == G2V_FRACTIONS_NEIGHBORS)
+		{
+			if ((j+1 < spans) && (changed[i+1] >= l)) return true;
+			if ((py+1 < height) && (changed[i+spans] >= l)) return true;
+		}
+		return false;
+	}
+
+	/// record the spans changed by the current step
+	void end(const Gray2Vec_StepType type)
+	{
+		const std::vector<Gray2Vec_Stats> &s = stats[pos];
+
+		for (int py = 0; py < height; py++)
+			for (int j = 0; j < spans; j++)
+			{
+				const size_t i = size_t(py)*spans + j;
+				if (s[i].cnt_tuned == 0) continue;
+				changed[i] = step;
+				if (type == G2V_FRACTIONS_NEIGHBORS)
+				{
+					if (j+1 < spans) changed[i+1] = step;
+					if (py+1 < height) changed[i+spans] = step;
+				}
+			}
+
+		last[pos] = step;
+	}
+
+	int spans;
+	int width;
+	int height;
+	/// number of the current step (counting from 1) and its position in the round
+	int step;
+	int pos;
+	/// step number of the last change of every span
+	std::vector<int> changed;
+	/// step number of the last run of the steps of the round (0: not run yet)
+	std::vector<int> last;
+	/// statistics of the spans from the last run of the steps of the round
+	std::vector< std::vector<Gray2Vec_Stats> > stats;
+};
+
+/// pixels per span of a line in the wavefront schedule
+static const int WaveSpan = 256;
+
+/// checks of the progress of the line above before a thread goes to sleep
+static const int WaveSpin = 4096;
+
+/// progress of the lines in the wavefront schedule of a neighbor adjustment
+/// (see Gray2Vec_Grid::StepWavefront()): the steps only read the four direct
+/// neighbors of the pixel they modify, so a span of a line can be processed
+/// once the line above is finished with it and the next span.  This keeps
+/// the order of the raster order for all reads and writes of neighboring
+/// pixels, the distance of a span also keeps the threads off the bytes of
+/// the packed codes of another line while they are modified.
+struct Gray2Vec_Wavefront
+{
+	explicit Gray2Vec_Wavefront(const int Height) : done(Height), sleeping(0)
+	{
+		for (int py = 0; py < Height; py++)
+			done[py].store(0);
+	}
+
+	/// wait until line py-1 is finished with the pixels up to x-1, the
+	/// lag is usually short so the thread only sleeps if it persists
+	void wait(const int py, const int x)
+	{
+		if (py == 0) return;
+
+		for (int i = 0; i < WaveSpin; i++)
+			if (done[py-1].load(std::memory_order_acquire) >= x) return;
+
+		std::unique_lock<std::mutex> lock(mutex);
+		sleeping++;
+		while (done[py-1].load() < x)
+			cond.wait(lock);
+		sleeping--;
+	}
+
+	/// line py is finished with the pixels up to x-1
+	void finish(const int py, const int x)
+	{
+		done[py].store(x);
+		if (sleeping.load() > 0)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			cond.notify_all();
+		}
+	}
+
+	/// number of pixels finished of every line
+	std::vector< std::atomic<int> > done;
+	/// threads waiting in cond
+	std::atomic<int> sleeping;
+	std::mutex mutex;
+	std::condition_variable cond;
+};
+
+void Gray2Vec_Grid::Process(const std::vector<Gray2Vec_Step> &Steps)
+{
+	if (m_window > 0)
+	{
+		if (m_processed)
+		{
+			std::fprintf(stderr,"  in streaming mode all steps have to be processed at once.\n\n");
+			std::exit(1);
+		}
+		if (!m_checkpoint_file.empty())
+		{
+			std::fprintf(stderr,"  checkpoints are not supported in streaming mode.\n\n");
+			std::exit(1);
+		}
+		if (m_convergence.enabled)
+		{
+			std::fprintf(stderr,"  convergence criteria are not supported in streaming mode.\n\n");
+			std::exit(1);
+		}
+		if (m_checkerboard)
+		{
+			std::fprintf(stderr,"  the checkerboard order is not supported in streaming mode.\n\n");
+			std::exit(1);
+		}
+		m_processed = true;
+		ProcessStreaming(Steps);
+		return;
+	}
+
+	size_t k0 = 0;
+
+	if (m_resume)
+	{
+		k0 = ReadCheckpoint(Steps);
+		m_resume = false;
+	}
+
+	Load();
+
+	Gray2Vec_Stats Stats;
+	Gray2Vec_Stats StatsPrev;
+
+	// statistics are collected for every line and summed up in order
+	// so they do not depend on the number of threads
+	std::vector<Gray2Vec_Stats> RowStats(m_height);
+
+	// statistics of the steps in the current and the previous round of a repeated phase
+	std::vector<Gray2Vec_Stats> StepStats(Steps.size());
+	std::vector<Gray2Vec_Stats> RoundStats(Steps.size());
+	int Round = 0;
+
+	// repeated phases consisting of fraction steps use a worklist,
+	// LoopEnd is the last step of the round a step belongs to
+	std::vector<size_t> LoopEnd(Steps.size(), Steps.size());
+
+	for (size_t k = 0; k < Steps.size(); k++)
+	{
+		if (Steps[k].loop <= 0) continue;
+
+		bool Fractions = (k+1 >= size_t(Steps[k].loop));
+
+		for (size_t k2 = k+1-Steps[k].loop; Fractions && (k2 <= k); k2++)
+			if ((Steps[k2].type != G2V_FRACTIONS_NEIGHBORS) && (Steps[k2].type != G2V_TUNE_FRACTIONS)) Fractions = false;
+
+		if (Fractions)
+			for (size_t k2 = k+1-Steps[k].loop; k2 <= k; k2++)
+				LoopEnd[k2] = k;
+	}
+
+	Gray2Vec_Worklist Work;
+	int nStep = 0;
+
+	for (size_t k = k0; k < Steps.size(); k++)
+	{
+		// the analysis works on lines of the separate planes and the
+		// initialization of the fractions allocates the fraction planes anew
+		if ((Steps[k].type == G2V_ANALYZE) || (Steps[k].type == G2V_INIT_FRACTIONS)) Deinterleave();
+
+		BeginStep(Steps[k]);
+
+		// the interleaved layout is used from the initialization of the fractions on
+		if (m_interleave && (Steps[k].type != G2V_ANALYZE) && (m_fractions || (Steps[k].type == G2V_INIT_FRACTIONS))) Interleave();
+
+		nStep++;
+
+		Gray2Vec_Worklist *pWork = NULL;
+
+		if (LoopEnd[k] < Steps.size())
+		{
+			const size_t k1 = LoopEnd[k]+1-Steps[LoopEnd[k]].loop;
+			if ((k == k1) && (Round == 0)) Work.begin(Steps[LoopEnd[k]].loop, m_width, m_height);
+			Work.step = nStep;
+			Work.pos = k-k1;
+			pWork = &Work;
+		}
+
+		// in checkerboard order the neighbor adjustments are run on the four color
+		// classes one after the other, the pixels of a class do not depend on each other
+		const bool Colors = m_checkerboard && !Gray2Vec_Grid::step_parallel(Steps[k].type);
+
+		if (Colors)
+			for (int py = 0; py < m_height; py++)
+				RowStats[py].clear();
+
+		for (int c = 0; c < (Colors ? 4 : 1); c++)
+		{
+			const int Color = Colors ? c : -1;
+
+			if ((m_threads > 1) && (Colors || Gray2Vec_Grid::step_parallel(Steps[k].type)))
+				m_pool->Run(m_height, PoolLines, std::bind(&Gray2Vec_Grid::StepRows, this, Steps[k], std::placeholders::_1, std::placeholders::_2, &RowStats[0], m_fractions, pWork, Color));
+			else if ((m_threads > 1) && (m_height > 1))
+				StepWavefront(Steps[k], &RowStats[0], m_fractions);
+			else if (m_height > 0)
+				StepRows(Steps[k], 0, m_height, &RowStats[0], m_fractions, pWork, Color);
+		}
+
+		if (pWork != NULL) Work.end(Steps[k].type);
+
+		Stats.clear();
+		for (int py = 0; py < m_height; py++)
+			Stats.add(RowStats[py]);
+
+		EndStep(Steps[k], Stats, (k > 0) ? &StatsPrev : NULL);
+
+		if (Steps[k].type == G2V_INIT_FRACTIONS) m_fractions = true;
+
+		StepStats[k] = Stats;
+		StatsPrev = Stats;
+
+		if (Steps[k].loop > 0)
+		{
+			const size_t k1 = k+1-Steps[k].loop;
+
+			Round++;
+
+			bool Converged = m_convergence.enabled && (Round > 1);
+
+			for (size_t k2 = k1; k2 <= k; k2++)
+			{
+				if (Converged && !m_convergence.converged(StepStats[k2], RoundStats[k2])) Converged = false;
+				RoundStats[k2] = StepStats[k2];
+			}
+
+			// next round starting with step k1
+			if (!Converged && (Round < Steps[k].rounds))
+			{
+				k = k1-1;
+				continue;
+			}
+
+			if (m_convergence.enabled)
+				std::fprintf(stderr,"  %s after %d of up to %d rounds\n", Converged ? "converged" : "stopped", Round, Steps[k].rounds);
+
+			Round = 0;
+		}
+
+		if (Steps[k].checkpoint && !m_checkpoint_file.empty())
+			WriteCheckpoint(Steps, k+1);
+
+		// the quad summaries are not needed after the last analysis
+		if (Steps[k].type == G2V_ANALYZE)
+		{
+			bool Analyze = false;
+			for (size_t k2 = k+1; k2 < Steps.size(); k2++)
+				if (Steps[k2].type == G2V_ANALYZE) Analyze = true;
+			if (!Analyze && !m_dual) m_img_q.clear();
+		}
+	}
+}
+
+// identification of checkpoint files
+static const char CheckpointMagic[16] = "gray2vec-ckpt-4";
+
+template<typename T> static bool write_plane(VSILFILE *fp, Gray2Vec_Plane<T> &Plane)
+{
+	const size_t n = size_t(Plane.width())*Plane.height();
+	return (VSIFWriteL(Plane.row(0), sizeof(T), n, fp) == n);
+}
+
+template<typename T> static bool read_plane(VSILFILE *fp, Gray2Vec_Plane<T> &Plane)
+{
+	const size_t n = size_t(Plane.width())*Plane.height();
+	return (VSIFReadL(Plane.row(0), sizeof(T), n, fp) == n);
+}
+
+void Gray2Vec_Grid::WriteCheckpoint(const std::vector<Gray2Vec_Step> &Steps, const size_t Done)
+{
+	std::fprintf(stderr,"Writing checkpoint after %zu of %zu steps...\n", Done, Steps.size());
+
+	// the checkpoint is written from the separate planes
+	Deinterleave();
+
+	// the checkpoint is written to a temporary file first so an
+	// interruption while writing does not destroy the previous one
+	const std::string file = m_checkpoint_file + ".tmp";
+
+	VSILFILE *fp = VSIFOpenL(file.c_str(), "wb");
+
+	if (fp == NULL)
+	{
+		std::fprintf(stderr,"  creating checkpoint file %s failed.\n\n", file.c_str());
+		std::exit(1);
+	}
+
+	char *pszWKT = NULL;
+	OSRExportToWkt(m_SRS, &pszWKT);
+	const std::string WKT = (pszWKT != NULL) ? pszWKT : "";
+	CPLFree(pszWKT);
+
+	const int anHeader[8] = { m_poBand->GetXSize(), m_poBand->GetYSize(), m_row0, m_height, int(Done), int(Steps.size()), m_fractions ? 1 : 0, int(WKT.size()) };
+	const double adfConvergence[5] = { m_convergence.enabled ? 1.0 : 0.0, m_convergence.df_max, m_convergence.df_avg, double(m_convergence.changed), double(m_convergence.pairs) };
+
+	bool Res = (VSIFWriteL(CheckpointMagic, 1, sizeof(CheckpointMagic), fp) == sizeof(CheckpointMagic));
+	Res = Res && (VSIFWriteL(anHeader, sizeof(int), 8, fp) == 8);
+	Res = Res && (VSIFWriteL(m_GeoTransform, sizeof(double), 6, fp) == 6);
+	Res = Res && (VSIFWriteL(adfConvergence, sizeof(double), 5, fp) == 5);
+	Res = Res && (VSIFWriteL(WKT.c_str(), 1, WKT.size(), fp) == WKT.size());
+
+	for (size_t k = 0; k < Steps.size(); k++)
+	{
+		const int nType = Steps[k].type;
+		const int anLoop[2] = { Steps[k].loop, Steps[k].rounds };
+		Res = Res && (VSIFWriteL(&nType, sizeof(int), 1, fp) == 1);
+		Res = Res && (VSIFWriteL(&Steps[k].max_error, sizeof(double), 1, fp) == 1);
+		Res = Res && (VSIFWriteL(anLoop, sizeof(int), 2, fp) == 2);
+	}
+
+	Res = Res && write_plane(fp, m_img_s);
+	Res = Res && write_plane(fp, m_img_n.packed());
+
+	if (m_fractions)
+	{
+		Res = Res && write_plane(fp, m_img_f1);
+		Res = Res && write_plane(fp, m_img_f2);
+		Res = Res && write_plane(fp, m_img_f3);
+	}
+
+	if ((VSIFCloseL(fp) != 0) || !Res)
+	{
+		VSIUnlink(file.c_str());
+		std::fprintf(stderr,"  error writing checkpoint file %s.\n\n", file.c_str());
+		std::exit(1);
+	}
+
+	if (VSIRename(file.c_str(), m_checkpoint_file.c_str()) != 0)
+	{
+		std::fprintf(stderr,"  error renaming checkpoint file %s.\n\n", file.c_str());
+		std::exit(1);
+	}
+}
+
+size_t Gray2Vec_Grid::ReadCheckpoint(const std::vector<Gray2Vec_Step> &Steps)
+{
+	VSILFILE *fp = VSIFOpenL(m_checkpoint_file.c_str(), "rb");
+
+	if (fp == NULL)
+	{
+		std::fprintf(stderr,"  no checkpoint %s found, processing from the start.\n", m_checkpoint_file.c_str());
+		return 0;
+	}
+
+	char Magic[sizeof(CheckpointMagic)];
+	int anHeader[8];
+	double GeoTransform[6];
+	double adfConvergence[5];
+
+	bool Res = (VSIFReadL(Magic, 1, sizeof(Magic), fp) == sizeof(Magic)) && (std::memcmp(Magic, CheckpointMagic, sizeof(Magic)) == 0);
+	Res = Res && (VSIFReadL(anHeader, sizeof(int), 8, fp) == 8);
+	Res = Res && (VSIFReadL(GeoTransform, sizeof(double), 6, fp) == 6);
+	Res = Res && (VSIFReadL(adfConvergence, sizeof(double), 5, fp) == 5);
+
+	// the checkpoint has to be from the same input, processing schedule and convergence criteria
+	Res = Res && (anHeader[0] == m_poBand->GetXSize()) && (anHeader[1] == m_poBand->GetYSize());
+	Res = Res && (anHeader[2] == m_row0) && (anHeader[3] == m_height);
+	Res = Res && (anHeader[4] > 0) && (anHeader[4] <= int(Steps.size())) && (anHeader[5] == int(Steps.size()));
+	Res = Res && (adfConvergence[0] == (m_convergence.enabled ? 1.0 : 0.0)) && (adfConvergence[1] == m_convergence.df_max) && (adfConvergence[2] == m_convergence.df_avg);
+	Res = Res && (adfConvergence[3] == double(m_convergence.changed)) && (adfConvergence[4] == double(m_convergence.pairs));
+
+	std::string WKT;
+
+	if (Res)
+	{
+		WKT.resize(anHeader[7]);
+		Res = (anHeader[7] == 0) || (VSIFReadL(&WKT[0], 1, anHeader[7], fp) == size_t(anHeader[7]));
+	}
+
+	for (size_t k = 0; Res && (k < Steps.size()); k++)
+	{
+		int nType;
+		double max_error;
+		int anLoop[2];
+		Res = (VSIFReadL(&nType, sizeof(int), 1, fp) == 1) && (VSIFReadL(&max_error, sizeof(double), 1, fp) == 1) && (VSIFReadL(anLoop, sizeof(int), 2, fp) == 2);
+		Res = Res && (nType == Steps[k].type) && (max_error == Steps[k].max_error);
+		Res = Res && (anLoop[0] == Steps[k].loop) && (anLoop[1] == Steps[k].rounds);
+	}
+
+	// the quad summaries needed for the analysis are not stored
+	for (size_t k = Res ? anHeader[4] : Steps.size(); k < Steps.size(); k++)
+		if (Steps[k].type == G2V_ANALYZE) Res = false;
+
+	if (!Res)
+	{
+		VSIFCloseL(fp);
+		std::fprintf(stderr,"  checkpoint %s does not match input and processing steps.\n\n", m_checkpoint_file.c_str());
+		std::exit(1);
+	}
+
+	std::fprintf(stderr,"Resuming from checkpoint %s after %d of %d steps...\n", m_checkpoint_file.c_str(), anHeader[4], anHeader[5]);
+
+	m_fractions = (anHeader[6] != 0);
+
+	std::copy(GeoTransform, GeoTransform+6, m_GeoTransform);
+	OSRDestroySpatialReference(m_SRS);
+	m_SRS = OSRNewSpatialReference(WKT.c_str());
+
+	Deinterleave();
+
+	m_img_s.assign(m_width, m_height);
+	m_img_n.assign(m_width, m_height);
+
+	Res = read_plane(fp, m_img_s) && read_plane(fp, m_img_n.packed());
+
+	if (m_fractions)
+	{
+		m_img_f1.assign(m_width, m_height);
+		m_img_f2.assign(m_width, m_height);
+		m_img_f3.assign(m_width, m_height);
+
+		Res = Res && read_plane(fp, m_img_f1) && read_plane(fp, m_img_f2) && read_plane(fp, m_img_f3);
+	}
+
+	VSIFCloseL(fp);
+
+	if (!Res)
+	{
+		std::fprintf(stderr,"  error reading checkpoint file %s.\n\n", m_checkpoint_file.c_str());
+		std::exit(1);
+	}
+
+	IndexRows(0, m_height);
+
+	m_loaded = true;
+
+	return anHeader[4];
+}
+
+void Gray2Vec_Grid::ProcessStreaming(const std::vector<Gray2Vec_Step> &Schedule)
+{
+	std::vector<Gray2Vec_Step> Steps;
+
+	for (size_t k = 0; k < Schedule.size(); k++)
+	{
+		Steps.push_back(Schedule[k]);
+
+		if (Schedule[k].loop > 0)
+			for (int i = 1; i < Schedule[k].rounds; i++)
+				for (size_t k2 = k+1-Schedule[k].loop; k2 <= k; k2++)
+					Steps.push_back(Schedule[k2]);
+	}
+
+	const int K = Steps.size();
+
+	if (K == 0) return;
+
+	// reach of the steps and if fractions are available at the time of the step
+	std::vector<int> reach(K);
+	std::vector<bool> fractions(K);
+	bool Fractions = m_fractions;
+
+	for (int k = 0; k < K; k++)
+	{
+		reach[k] = step_reach(Steps[k].type);
+		fractions[k] = Fractions;
+		if (Steps[k].type == G2V_INIT_FRACTIONS) Fractions = true;
+	}
+
+	m_fractions = Fractions;
+
+	// step k can process line y once the previous step is finished with all
+	// lines up to y + reach[k] and will not modify them any more.  This results
+	// in a lag between the lines loaded and the lines finished.
+	int lag = reach[0]+1;
+	for (int k = 1; k < K; k++)
+		lag += reach[k]+reach[k-1]+1;
+	lag += reach[K-1];
+
+	if (m_window < lag+1)
+	{
+		std::fprintf(stderr,"  increasing window to %d lines for %d processing steps\n", lag+1, K);
+		m_window = lag+1;
+	}
+
+	m_img_q.assign(m_width, m_height, m_window);
+	m_img_s.assign(m_width, m_height, m_window);
+	m_img_n.assign(m_width, m_height, m_window);
+	m_img_f1.assign(m_width, m_height, m_window);
+	m_img_f2.assign(m_width, m_height, m_window);
+	m_img_f3.assign(m_width, m_height, m_window);
+	m_img_e.assign(m_width, m_height, m_window);
+
+	m_reader = new Gray2Vec_Reader(m_file, m_band, m_row0*2, (m_row0+m_height)*2, m_threads);
+
+	m_spool_file = CPLGenerateTempFilename("gray2vec");
+	m_spool = VSIFOpenL(m_spool_file.c_str(), "w+b");
+
+	if (m_spool == NULL)
+	{
+		std::fprintf(stderr,"  creating temporary file %s failed.\n\n", m_spool_file.c_str());
+		std::exit(1);
+	}
+
+	if (m_debug)
+		std::fprintf(stderr,"  debug images are not written in streaming mode.\n");
+
+	std::vector<Gray2Vec_Stats> stats(K);
+	std::vector<int> done(K, 0);
+	int loaded = 0;
+	int spooled = 0;
+
+	while (spooled < m_height)
+	{
+		bool progress = false;
+
+		// read the next lines if there is space in the window
+		if ((loaded < m_height) && (loaded-spooled < m_window))
+		{
+			const int y1 = std::min(m_height, spooled+m_window);
+
+			m_img_q.scroll(spooled);
+			m_img_s.scroll(spooled);
+			m_img_n.scroll(spooled);
+			m_img_f1.scroll(spooled);
+			m_img_f2.scroll(spooled);
+			m_img_f3.scroll(spooled);
+			m_img_e.scroll(spooled);
+
+			LoadRows(loaded, y1);
+			loaded = y1;
+			progress = true;
+		}
+
+		for (int k = 0; k < K; k++)
+		{
+			const int avail = (k == 0) ? loaded : done[k-1];
+			const int need = (k == 0) ? reach[0]+1 : reach[k]+reach[k-1]+1;
+
+			if (done[k] == m_height) continue;
+
+			while ((done[k] < m_height) && (avail >= std::min(m_height, done[k]+need)))
+			{
+				Gray2Vec_Stats RowStats;
+				StepRow(Steps[k], done[k], RowStats, fractions[k], -1);
+				stats[k].add(RowStats);
+				done[k]++;
+				progress = true;
+			}
+
+			if (done[k] == m_height)
+			{
+				BeginStep(Steps[k]);
+				EndStep(Steps[k], stats[k], (k > 0) ? &stats[k-1] : NULL);
+			}
+		}
+
+		// lines not modified by the last step any more are final
+		while ((spooled < m_height) && (done[K-1] >= std::min(m_height, spooled+reach[K-1]+1)))
+		{
+			SpoolRow(spooled);
+			spooled++;
+			progress = true;
+		}
+
+		if (!progress)
+		{
+			std::fprintf(stderr,"  processing window too small.\n\n");
+			std::exit(1);
+		}
+	}
+
+	delete m_reader;
+	m_reader = NULL;
+
+	m_img_q.clear();
+	m_img_s.clear();
+	m_img_n.clear();
+	m_img_f1.clear();
+	m_img_f2.clear();
+	m_img_f3.clear();
+	m_img_e.clear();
+}
+
+void Gray2Vec_Grid::BeginStep(const Gray2Vec_Step &Step)
+{
+	switch (Step.type)
+	{
+		case G2V_ANALYZE:
+			std::fprintf(stderr,"Determining sides...\n");
+			break;
+		case G2V_OPTIMIZE_SIDES:
+			std::fprintf(stderr,"Optimizing sides...\n");
+			break;
+		case G2V_SMOOTH_EDGES:
+			std::fprintf(stderr,"Smoothing edges...\n");
+			break;
+		case G2V_RESOLVE_CONFLICTS1:
+			std::fprintf(stderr,"Resolving conflicts (1)...\n");
+			break;
+		case G2V_RESOLVE_CONFLICTS2:
+			std::fprintf(stderr,"Resolving conflicts (2)...\n");
+			break;
+		case G2V_INIT_FRACTIONS:
+			std::fprintf(stderr,"Determining initial fractions...\n");
+			break;
+		case G2V_FRACTIONS_NEIGHBORS:
+			std::fprintf(stderr,"Adjusting neighbor fractions to match...\n");
+			break;
+		case G2V_TUNE_FRACTIONS:
+			std::fprintf(stderr,"Tuning fractions...\n");
+			break;
+		case G2V_ADJUST_TYPES:
+			std::fprintf(stderr,"Adjusting pixel types...\n");
+			break;
+	}
+
+	// in streaming mode the planes are allocated for all steps together
+	if (m_window > 0) return;
+
+	if (Step.type == G2V_INIT_FRACTIONS)
+	{
+		// fractions apply clockwise to the pixel sides
+		m_img_f1.assign(m_width, m_height);
+		m_img_f2.assign(m_width, m_height);
+		m_img_f3.assign(m_width, m_height);
+	}
+
+	// the errors of pixels not processed again (see Gray2Vec_Worklist) are kept
+	if ((Step.type == G2V_TUNE_FRACTIONS) && ((m_img_e.width() != m_width) || (m_img_e.height() != m_height)))
+		m_img_e.assign(m_width, m_height);
+}
+
+void Gray2Vec_Grid::EndStep(const Gray2Vec_Step &Step, const Gray2Vec_Stats &Stats, const Gray2Vec_Stats *Prev)
+{
+	switch (Step.type)
+	{
+		case G2V_RESOLVE_CONFLICTS2:
+			std::fprintf(stderr,"  changed %ld + %ld pixels\n", (Prev != NULL) ? Prev->cnt_changed : 0, Stats.cnt_changed);
+			break;
+		case G2V_ADJUST_TYPES:
+			std::fprintf(stderr,"  changed %ld pixels\n", Stats.cnt_changed);
+			break;
+		case G2V_INIT_FRACTIONS:
+			std::fprintf(stderr,"  %ld side, %ld + %ld corner of %ld pixels\n", Stats.cnt_side, Stats.cnt_corner, Stats.cnt_corner2, Stats.cnt_all);
+			break;
+		case G2V_FRACTIONS_NEIGHBORS:
+			if (Stats.df_cnt > 0)
+				std::fprintf(stderr,"  %ld pairs, maximum error: %.3f, average: %.3f\n", Stats.df_cnt/2, Stats.df_max, Stats.df_sum/Stats.df_cnt);
+			break;
+		case G2V_TUNE_FRACTIONS:
+			if (Stats.df_cnt > 0)
+			{
+				std::fprintf(stderr,"  %ld + %ld + %ld side, %ld + %ld + %ld small corner , %ld + %ld + %ld large corner\n", Stats.cnt_side, Stats.cnt_side_n, Stats.cnt_side_s, Stats.cnt_corner, Stats.cnt_corner_n, Stats.cnt_corner_s, Stats.cnt_corner2, Stats.cnt_corner2_n, Stats.cnt_corner2_s);
+
+				std::fprintf(stderr,"  maximum error: %.1f, average: %.1f (%.3f), %ld + %ld + %ld changed\n", Stats.df_max, Stats.df_sum/Stats.df_cnt, (Stats.df_sum/Stats.df_cnt)/255, Stats.cnt_changed_type, Stats.cnt_changed, Stats.cnt_changed2);
+			}
+
+			if (m_debug && (m_window == 0))  m_img_e.image().save("debug-e.tif");
+			break;
+		default:
+			break;
+	}
+}
+
+void Gray2Vec_Grid::StepRow(const Gray2Vec_Step &Step, const int py, Gray2Vec_Stats &Stats, const bool Fractions, const int Color)
+{
+	// the analysis determines the codes of the uniform pixels as well
+	if (Step.type == G2V_ANALYZE)
+		AnalyzeRow(py);
+	else
+		StepSpan(Step, py, 0, m_width, Stats, Fractions, Color);
+}
+
+void Gray2Vec_Grid::StepSpan(const Gray2Vec_Step &Step, const int py, const int x0, const int x1, Gray2Vec_Stats &Stats, const bool Fractions, const int Color)
+{
+	const int by = py/BlockSize;
+
+	// runs of uniform and partial blocks
+	for (int px0 = x0; px0 < x1; )
+	{
+		const bool Uniform = block_uniform(px0/BlockSize, by);
+
+		int px1 = std::min(x1, (px0/BlockSize+1)*BlockSize);
+
+		while ((px1 < x1) && (block_uniform(px1/BlockSize, by) == Uniform))
+			px1 = std::min(x1, px1+BlockSize);
+
+		if (Uniform)
+			StepUniform(Step, py, px0, px1, Stats);
+		else
+			StepPixels(Step, py, px0, px1, Stats, Fractions, Color);
+
+		px0 = px1;
+	}
+}
+
+void Gray2Vec_Grid::StepPixels(const Gray2Vec_Step &Step, const int py, const int x0, const int x1, Gray2Vec_Stats &Stats, const bool Fractions, const int Color)
+{
+	// the pixels of a color class are every second pixel starting with the column parity of the class
+	const int xc = (Color < 0) ? x0 : x0 + ((x0 + Color) & 1);
+	const int dx = (Color < 0) ? 1 : 2;
+
+	switch (Step.type)
+	{
+		case G2V_ANALYZE:
+			break;
+		case G2V_OPTIMIZE_SIDES:
+			OptimizeSidesRow(py, xc, x1, dx);
+			break;
+		case G2V_SMOOTH_EDGES:
+			SmoothEdgesRow(py, xc, x1, dx);
+			break;
+		case G2V_RESOLVE_CONFLICTS1:
+			ResolveConflictsRow1(py, xc, x1, dx, Stats, Fractions);
+			break;
+		case G2V_RESOLVE_CONFLICTS2:
+			ResolveConflictsRow2(py, xc, x1, dx, Stats, Fractions);
+			break;
+		case G2V_INIT_FRACTIONS:
+			InitFractionsRow(py, x0, x1, Stats);
+			break;
+		case G2V_FRACTIONS_NEIGHBORS:
+			FractionsNeighborsAdjRow(py, x0, x1, Stats);
+			break;
+		case G2V_TUNE_FRACTIONS:
+			TuneFractionsRow(py, x0, x1, Step.max_error, Stats);
+			break;
+		case G2V_ADJUST_TYPES:
+			NeighborsAdjust2Row(py, xc, x1, dx, Stats);
+			break;
+	}
+}
+
+void Gray2Vec_Grid::StepUniform(const Gray2Vec_Step &Step, const int py, const int x0, const int x1, Gray2Vec_Stats &Stats)
+{
+	// empty and full pixels keep their codes and have no fractions
+	// (see set_fraction()) and no error (see TuneFractionsRow())
+	switch (Step.type)
+	{
+		case G2V_INIT_FRACTIONS:
+			for (int px = x0; px < x1; px++)
+			{
+				m_img_f1(px,py) = 0;
+				m_img_f2(px,py) = 0;
+				m_img_f3(px,py) = -1;
+			}
+			Stats.cnt_all += x1-x0;
+			break;
+		case G2V_TUNE_FRACTIONS:
+			for (int px = x0; px < x1; px++)
+				m_img_e(px,py) = 0;
+			Stats.cnt_all += x1-x0;
+			break;
+		default:
+			break;
+	}
+}
+
+void Gray2Vec_Grid::StepRows(const Gray2Vec_Step &Step, const int y0, const int y1, Gray2Vec_Stats *RowStats, const bool Fractions, Gray2Vec_Worklist *Work, const int Color)
+{
+	for (int py = y0; py < y1; py++)
+	{
+		// the statistics of the color classes are added up
+		if (Color >= 0)
+		{
+			if ((py & 1) == (Color >> 1))
+				StepRow(Step, py, RowStats[py], Fractions, Color);
+			continue;
+		}
+
+		RowStats[py].clear();
+
+		if (Work == NULL)
+		{
+			StepRow(Step, py, RowStats[py], Fractions, Color);
+			continue;
+		}
+
+		// the statistics of the spans are added up in order like for whole lines
+		for (int j = 0; j < Work->spans; j++)
+		{
+			Gray2Vec_Stats &Stats = Work->stats[Work->pos][size_t(py)*Work->spans + j];
+
+			if (Work->dirty(Step.type, py, j))
+			{
+				const int x0 = j*WorkSpan;
+				const int x1 = std::min(x0+WorkSpan, m_width);
+
+				Stats.clear();
+				StepSpan(Step, py, x0, x1, Stats, Fractions, Color);
+			}
+
+			RowStats[py].add(Stats);
+		}
+	}
+}
+
+void Gray2Vec_Grid::StepWavefront(const Gray2Vec_Step &Step, Gray2Vec_Stats *RowStats, const bool Fractions)
+{
+	Gray2Vec_Wavefront Wave(m_height);
+
+	// one chunk per thread of the pool, each processing every n-th line
+	m_pool->Run(m_pool->threads(), 1, std::bind(&Gray2Vec_Grid::StepRowsWavefront, this, Step, std::placeholders::_1, std::placeholders::_2, RowStats, Fractions, &Wave));
+}
+
+void Gray2Vec_Grid::StepRowsWavefront(const Gray2Vec_Step &Step, const int t0, const int t1, Gray2Vec_Stats *RowStats, const bool Fractions, Gray2Vec_Wavefront *Wave)
+{
+	const int T = m_pool->threads();
+
+	for (int t = t0; t < t1; t++)
+		for (int py = t; py < m_height; py += T)
+		{
+			RowStats[py].clear();
+
+			for (int x0 = 0; x0 < m_width; x0 += WaveSpan)
+			{
+				const int x1 = std::min(x0+WaveSpan, m_width);
+
+				Wave->wait(py, std::min(x1+WaveSpan, m_width));
+				StepSpan(Step, py, x0, x1, RowStats[py], Fractions, -1);
+				Wave->finish(py, x1);
+			}
+		}
+}
+
+void Gray2Vec_Grid::Analyze()
+{
+	std::vector<Gray2Vec_Step> Steps;
+	Steps.push_back(Gray2Vec_Step(G2V_ANALYZE));
+	Process(Steps);
+}
+
+unsigned char Gray2Vec_Grid::quad_summary(const int v1, const int v3, const int v7, const int v5)
+{
+	// highest value corner, if several are equal the last one
+	// in the order 1, 3, 7, 5 is used
+	const int mc = std::max(std::max(v1, v3), std::max(v7, v5));
+	const int c = (v5 == mc) ? 5 : ((v7 == mc) ? 7 : ((v3 == mc) ? 3 : 1));
+
+	// highest value side, if several are equal the last one
+	// in the order 2, 4, 6, 8 is used
+	const int s2 = v1 + v3;
+	const int s4 = v5 + v3;
+	const int s6 = v5 + v7;
+	const int s8 = v1 + v7;
+
+	const int ms = std::max(std::max(s2, s4), std::max(s6, s8));
+	const int s = (s8 == ms) ? 8 : ((s6 == ms) ? 6 : ((s4 == ms) ? 4 : 2));
+
+	return c | (s << 4);
+}
+
+void Gray2Vec_Grid::quad_summary_row(const unsigned char *r0, const unsigned char *r1, unsigned char *q, const int w)
+{
+	int x = 0;
+
+#ifdef __SSE2__
+	const __m128i mask = _mm_set1_epi16(0x00ff);
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; x+16 <= w; x += 16)
+	{
+		const __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(r0+x*2));
+		const __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(r0+x*2+16));
+		const __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(r1+x*2));
+		const __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(r1+x*2+16));
+
+		// corner values of 16 quads
+		const __m128i v1 = _mm_packus_epi16(_mm_and_si128(a0, mask), _mm_and_si128(a1, mask));
+		const __m128i v3 = _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(a1, 8));
+		const __m128i v7 = _mm_packus_epi16(_mm_and_si128(b0, mask), _mm_and_si128(b1, mask));
+		const __m128i v5 = _mm_packus_epi16(_mm_srli_epi16(b0, 8), _mm_srli_epi16(b1, 8));
+
+		// highest value corner, later ones in the order 1, 3, 7, 5 take precedence
+		const __m128i mc = _mm_max_epu8(_mm_max_epu8(v1, v3), _mm_max_epu8(v7, v5));
+		__m128i c = _mm_set1_epi8(1);
+		c = select_epi8(_mm_cmpeq_epi8(v3, mc), _mm_set1_epi8(3), c);
+		c = select_epi8(_mm_cmpeq_epi8(v7, mc), _mm_set1_epi8(7), c);
+		c = select_epi8(_mm_cmpeq_epi8(v5, mc), _mm_set1_epi8(5), c);
+
+		// highest value side, the sums need 16 bit so the comparison
+		// is done for 8 quads at a time and the results are packed again
+		__m128i m4[2], m6[2], m8[2];
+
+		for (int h = 0; h < 2; h++)
+		{
+			const __m128i w1 = h ? _mm_unpackhi_epi8(v1, zero) : _mm_unpacklo_epi8(v1, zero);
+			const __m128i w3 = h ? _mm_unpackhi_epi8(v3, zero) : _mm_unpacklo_epi8(v3, zero);
+			const __m128i w7 = h ? _mm_unpackhi_epi8(v7, zero) : _mm_unpacklo_epi8(v7, zero);
+			const __m128i w5 = h ? _mm_unpackhi_epi8(v5, zero) : _mm_unpacklo_epi8(v5, zero);
+
+			const __m128i s2 = _mm_add_epi16(w1, w3);
+			const __m128i s4 = _mm_add_epi16(w5, w3);
+			const __m128i s6 = _mm_add_epi16(w5, w7);
+			const __m128i s8 = _mm_add_epi16(w1, w7);
+
+			const __m128i ms = _mm_max_epi16(_mm_max_epi16(s2, s4), _mm_max_epi16(s6, s8));
+
+			m4[h] = _mm_cmpeq_epi16(s4, ms);
+			m6[h] = _mm_cmpeq_epi16(s6, ms);
+			m8[h] = _mm_cmpeq_epi16(s8, ms);
+		}
+
+		// side codes already shifted to the upper 4 bits
+		__m128i sd = _mm_set1_epi8(2 << 4);
+		sd = select_epi8(_mm_packs_epi16(m4[0], m4[1]), _mm_set1_epi8(4 << 4), sd);
+		sd = select_epi8(_mm_packs_epi16(m6[0], m6[1]), _mm_set1_epi8(6 << 4), sd);
+		sd = select_epi8(_mm_packs_epi16(m8[0], m8[1]), _mm_set1_epi8(char(8 << 4)), sd);
+
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(q+x), _mm_or_si128(c, sd));
+	}
+#endif
+
+	for (; x < w; x++)
+		q[x] = quad_summary(r0[x*2], r0[x*2+1], r1[x*2], r1[x*2+1]);
+}
+
+void Gray2Vec_Grid::AnalyzeRow(const int py)
+{
+	const unsigned char *s = m_img_s.row(py);
+	const unsigned char *q = m_img_q.row(py);
+	unsigned char *n = m_img_n.row(py);
+
+	// two pixels per byte (see Gray2Vec_CodePlane)
+	for (int px = 0; px < m_width; px += 2)
+	{
+		n[px/2] = AnalyzeTable.state[AnalyzeTable.range[s[px]]][q[px]];
+		if (px+1 < m_width)
+			n[px/2] |= AnalyzeTable.state[AnalyzeTable.range[s[px+1]]][q[px+1]] << 4;
+	}
+}
+
+
+void Gray2Vec_Grid::NeighborsAdjust()
+{
+	std::vector<Gray2Vec_Step> Steps;
+	Steps.push_back(Gray2Vec_Step(G2V_OPTIMIZE_SIDES));
+	Steps.push_back(Gray2Vec_Step(G2V_SMOOTH_EDGES));
+	Process(Steps);
+}
+
+/// mask of direction d in Gray2Vec_CoverTable
+static constexpr unsigned short bit(const int d) { return 1 << d; }
+
+/// a rule term: the directions covered by neighbour nb masked with sel are
+/// compared to val, the term is true if they are equal (or not equal with ne)
+struct Gray2Vec_RuleTerm
+{
+	unsigned char nb;
+	unsigned short sel;
+	unsigned short val;
+	bool ne;
+};
+
+/// neighbour nb covers all directions in yes and none in no
+static constexpr Gray2Vec_RuleTerm covers(const int nb, const unsigned short yes, const unsigned short no)
+{
+	return Gray2Vec_RuleTerm { (unsigned char)nb, (unsigned short)(yes | no), yes, false };
+}
+
+/// neighbour nb does not cover all directions in yes and none in no
+static constexpr Gray2Vec_RuleTerm not_covers(const int nb, const unsigned short yes, const unsigned short no)
+{
+	return Gray2Vec_RuleTerm { (unsigned char)nb, (unsigned short)(yes | no), yes, true };
+}
+
+/// fraction preconditions of rules (see Gray2Vec_Rule)
+static const int FracAny = 0;
+static const int FracF1Full = 1;
+static const int FracF2Full = 2;
+static const int FracF1Empty = 3;
+static const int FracF2Empty = 4;
+
+static inline bool fraction_holds(const int frac, const int f1, const int f2)
+{
+	switch (frac)
+	{
+		case FracF1Full: return (f1 == 255);
+		case FracF2Full: return (f2 == 255);
+		case FracF1Empty: return (f1 == 0);
+		case FracF2Empty: return (f2 == 0);
+	}
+	return true;
+}
+
+/// a pixel with neighbourhood code is changed to result if all terms are true
+/// and the neighbour full (if not -1) is fully covered.  Unused terms are
+/// always true.  The rules for a code are tried in order until one matches.
+/// Rules with a fraction precondition frac form consecutive groups with the
+/// same precondition, only the group of the first precondition that holds
+/// is tried (like an if/else if chain over the fractions).
+struct Gray2Vec_Rule
+{
+	unsigned char code;
+	unsigned char result;
+	signed char full;
+	Gray2Vec_RuleTerm terms[3];
+	unsigned char frac;
+};
+
+/// first rule and number of rules for every code, rules
+/// for the same code have to be consecutive in the table
+struct Gray2Vec_RuleIndex
+{
+	unsigned char first[256];
+	unsigned char count[256];
+};
+
+template<size_t N> static constexpr Gray2Vec_RuleIndex make_rule_index(const Gray2Vec_Rule (&Rules)[N])
+{
+	Gray2Vec_RuleIndex Index = {};
+	for (size_t i = N; i-- > 0; )
+	{
+		Index.first[Rules[i].code] = i;
+		Index.count[Rules[i].code]++;
+	}
+	return Index;
+}
+
+/// change corners to sides depending on neighbors (for pixels with more than 1/6 coverage)
+static constexpr Gray2Vec_Rule OptimizeSidesRules[] =
+{
+	{ 1, 2, -1, { covers(NbN, bit(6), 0), covers(NbE, bit(1), 0) } },
+	{ 1, 8, -1, { covers(NbW, bit(4), 0), covers(NbS, bit(1), 0) } },
+	{ 3, 2, -1, { covers(NbN, bit(6), 0), covers(NbW, bit(3), 0) } },
+	{ 3, 4, -1, { covers(NbE, bit(8), 0), covers(NbS, bit(3), 0) } },
+	{ 5, 6, -1, { covers(NbS, bit(6), 0), covers(NbW, bit(5), 0) } },
+	{ 5, 4, -1, { covers(NbE, bit(4), 0), covers(NbN, bit(5), 0) } },
+	{ 7, 8, -1, { covers(NbW, bit(4), 0), covers(NbN, bit(7), 0) } },
+	{ 7, 6, -1, { covers(NbS, bit(2), 0), covers(NbE, bit(7), 0) } },
+};
+
+static constexpr Gray2Vec_RuleIndex OptimizeSidesIndex = make_rule_index(OptimizeSidesRules);
+
+static constexpr Gray2Vec_Rule SmoothEdgesRules[] =
+{
+	{ 1, 8, NbW, { covers(NbS, bit(1), 0) } },
+	{ 1, 2, NbN, { covers(NbE, bit(1), 0) } },
+	{ 3, 2, NbN, { covers(NbW, bit(3), 0) } },
+	{ 3, 4, NbE, { covers(NbS, bit(3), 0) } },
+	{ 5, 4, NbE, { covers(NbN, bit(5), 0) } },
+	{ 5, 6, NbS, { covers(NbW, bit(5), 0) } },
+	{ 7, 6, NbS, { covers(NbE, bit(7), 0) } },
+	{ 7, 8, NbW, { covers(NbN, bit(7), 0) } },
+	{ 11, 8, -1, { covers(NbE, 0, bit(7) | bit(1)), covers(NbN, 0, bit(5)) } },
+	{ 11, 2, -1, { covers(NbS, 0, bit(1) | bit(3)), covers(NbW, 0, bit(5)) } },
+	{ 13, 2, -1, { covers(NbS, 0, bit(1) | bit(3)), covers(NbE, 0, bit(7)) } },
+	{ 13, 4, -1, { covers(NbW, 0, bit(3) | bit(5)), covers(NbN, 0, bit(7)) } },
+	{ 15, 4, -1, { covers(NbW, 0, bit(3) | bit(5)), covers(NbS, 0, bit(1)) } },
+	{ 15, 6, -1, { covers(NbN, 0, bit(5) | bit(7)), covers(NbE, 0, bit(1)) } },
+	{ 17, 6, -1, { covers(NbN, 0, bit(5) | bit(7)), covers(NbW, 0, bit(3)) } },
+	{ 17, 8, -1, { covers(NbE, 0, bit(7) | bit(1)), covers(NbS, 0, bit(3)) } },
+};
+
+static constexpr Gray2Vec_RuleIndex SmoothEdgesIndex = make_rule_index(SmoothEdgesRules);
+
+static constexpr Gray2Vec_Rule ResolveConflicts1Rules[] =
+{
+	{ 1, 7, -1, { covers(NbW, bit(5), bit(3)), covers(NbS, bit(1), 0) } },
+	{ 1, 3, -1, { covers(NbN, bit(5), bit(7)), covers(NbE, bit(1), 0) } },
+	{ 3, 1, -1, { covers(NbN, bit(7), bit(5)), covers(NbW, bit(3), 0) } },
+	{ 3, 5, -1, { covers(NbE, bit(7), bit(1)), covers(NbS, bit(3), 0) } },
+	{ 5, 3, -1, { covers(NbE, bit(1), bit(7)), covers(NbN, bit(5), 0) } },
+	{ 5, 7, -1, { covers(NbS, bit(1), bit(3)), covers(NbW, bit(5), 0) } },
+	{ 7, 5, -1, { covers(NbS, bit(3), bit(1)), covers(NbE, bit(7), 0) } },
+	{ 7, 1, -1, { covers(NbW, bit(3), bit(5)), covers(NbN, bit(7), 0) } },
+	{ 15, 13, -1, { covers(NbW, bit(3), bit(5)), covers(NbS, 0, bit(1)) } },
+	{ 15, 17, -1, { covers(NbN, bit(7), bit(5)), covers(NbE, 0, bit(1)) } },
+	{ 17, 15, -1, { covers(NbN, bit(5), bit(7)), covers(NbW, 0, bit(3)) } },
+	{ 17, 11, -1, { covers(NbE, bit(1), bit(7)), covers(NbS, 0, bit(3)) } },
+	{ 11, 17, -1, { covers(NbE, bit(7), bit(1)), covers(NbN, 0, bit(5)) } },
+	{ 11, 13, -1, { covers(NbS, bit(3), bit(1)), covers(NbW, 0, bit(5)) } },
+	{ 13, 11, -1, { covers(NbS, bit(1), bit(3)), covers(NbE, 0, bit(7)) } },
+	{ 13, 15, -1, { covers(NbW, bit(5), bit(3)), covers(NbN, 0, bit(7)) } },
+	{ 2, 4, -1, { covers(NbW, bit(5), bit(3)), not_covers(NbN, bit(7), bit(5)), not_covers(NbS, bit(1), bit(3)) } },
+	{ 2, 8, -1, { covers(NbE, bit(7), bit(1)), not_covers(NbW, bit(5), bit(7)), not_covers(NbE, bit(3), bit(1)) } },
+	{ 6, 4, -1, { covers(NbW, bit(3), bit(5)), not_covers(NbN, bit(7), bit(5)), not_covers(NbS, bit(1), bit(3)) } },
+	{ 6, 8, -1, { covers(NbE, bit(1), bit(7)), not_covers(NbW, bit(5), bit(7)), not_covers(NbE, bit(3), bit(1)) } },
+	{ 4, 6, -1, { covers(NbN, bit(7), bit(5)), not_covers(NbW, bit(3), bit(5)), not_covers(NbE, bit(1), bit(7)) } },
+	{ 4, 2, -1, { covers(NbS, bit(1), bit(3)), not_covers(NbW, bit(5), bit(3)), not_covers(NbE, bit(7), bit(1)) } },
+	{ 8, 6, -1, { covers(NbN, bit(5), bit(7)), not_covers(NbW, bit(3), bit(5)), not_covers(NbE, bit(1), bit(7)) } },
+	{ 8, 2, -1, { covers(NbS, bit(3), bit(1)), not_covers(NbW, bit(5), bit(3)), not_covers(NbE, bit(7), bit(1)) } },
+};
+
+static constexpr Gray2Vec_RuleIndex ResolveConflicts1Index = make_rule_index(ResolveConflicts1Rules);
+
+static constexpr Gray2Vec_Rule ResolveConflicts2Rules[] =
+{
+	{ 1, 7, -1, { covers(NbW, bit(5), bit(3)), covers(NbS, 0, bit(3)) } },
+	{ 1, 3, -1, { covers(NbN, bit(5), bit(7)), covers(NbE, 0, bit(7)) } },
+	{ 3, 1, -1, { covers(NbN, bit(7), bit(5)), covers(NbW, 0, bit(5)) } },
+	{ 3, 5, -1, { covers(NbE, bit(7), bit(1)), covers(NbS, 0, bit(1)) } },
+	{ 5, 3, -1, { covers(NbE, bit(1), bit(7)), covers(NbN, 0, bit(7)) } },
+	{ 5, 7, -1, { covers(NbS, bit(1), bit(3)), covers(NbW, 0, bit(3)) } },
+	{ 7, 5, -1, { covers(NbS, bit(3), bit(1)), covers(NbE, 0, bit(1)) } },
+	{ 7, 1, -1, { covers(NbW, bit(3), bit(5)), covers(NbN, 0, bit(5)) } },
+	{ 15, 13, -1, { covers(NbW, bit(3), bit(5)), covers(NbS, bit(3), 0) } },
+	{ 15, 17, -1, { covers(NbN, bit(7), bit(5)), covers(NbE, bit(7), 0) } },
+	{ 17, 15, -1, { covers(NbN, bit(5), bit(7)), covers(NbW, bit(5), 0) } },
+	{ 17, 11, -1, { covers(NbE, bit(1), bit(7)), covers(NbS, bit(1), 0) } },
+	{ 11, 17, -1, { covers(NbE, bit(7), bit(1)), covers(NbN, bit(7), 0) } },
+	{ 11, 13, -1, { covers(NbS, bit(3), bit(1)), covers(NbW, bit(3), 0) } },
+	{ 13, 11, -1, { covers(NbS, bit(1), bit(3)), covers(NbE, bit(1), 0) } },
+	{ 13, 15, -1, { covers(NbW, bit(5), bit(3)), covers(NbN, bit(5), 0) } },
+	{ 2, 6, -1, { covers(NbW, bit(5), bit(3)), not_covers(NbE, bit(1), bit(7)) } },
+	{ 2, 6, -1, { covers(NbE, bit(7), bit(1)), not_covers(NbW, bit(3), bit(5)) } },
+	{ 6, 2, -1, { covers(NbW, bit(3), bit(5)), not_covers(NbE, bit(7), bit(1)) } },
+	{ 6, 2, -1, { covers(NbE, bit(1), bit(7)), not_covers(NbW, bit(5), bit(3)) } },
+	{ 4, 8, -1, { covers(NbN, bit(7), bit(5)), not_covers(NbS, bit(3), bit(1)) } },
+	{ 4, 8, -1, { covers(NbS, bit(1), bit(3)), not_covers(NbN, bit(5), bit(7)) } },
+	{ 8, 4, -1, { covers(NbN, bit(5), bit(7)), not_covers(NbS, bit(1), bit(3)) } },
+	{ 8, 4, -1, { covers(NbS, bit(3), bit(1)), not_covers(NbN, bit(7), bit(5)) } },
+};
+
+static constexpr Gray2Vec_RuleIndex ResolveConflicts2Index = make_rule_index(ResolveConflicts2Rules);
+
+/// change corners to sides and sides to corners depending on neighbors
+/// for pixels with a fully covered or empty fraction
+static constexpr Gray2Vec_Rule NeighborsAdjust2Rules[] =
+{
+	{ 1, 2, -1, { not_covers(NbE, bit(7), bit(1)) }, FracF1Full },
+	{ 1, 8, -1, { not_covers(NbS, bit(3), bit(1)) }, FracF1Full },
+	{ 1, 8, -1, { not_covers(NbS, bit(3), bit(1)) }, FracF2Full },
+	{ 1, 2, -1, { not_covers(NbE, bit(7), bit(1)) }, FracF2Full },
+	{ 3, 4, -1, { not_covers(NbS, bit(1), bit(3)) }, FracF1Full },
+	{ 3, 2, -1, { not_covers(NbW, bit(5), bit(3)) }, FracF1Full },
+	{ 3, 2, -1, { not_covers(NbW, bit(5), bit(3)) }, FracF2Full },
+	{ 3, 4, -1, { not_covers(NbS, bit(1), bit(3)) }, FracF2Full },
+	{ 5, 6, -1, { not_covers(NbW, bit(3), bit(5)) }, FracF1Full },
+	{ 5, 4, -1, { not_covers(NbN, bit(7), bit(5)) }, FracF1Full },
+	{ 5, 4, -1, { not_covers(NbN, bit(7), bit(5)) }, FracF2Full },
+	{ 5, 6, -1, { not_covers(NbW, bit(3), bit(5)) }, FracF2Full },
+	{ 7, 8, -1, { not_covers(NbN, bit(5), bit(7)) }, FracF1Full },
+	{ 7, 6, -1, { not_covers(NbE, bit(1), bit(7)) }, FracF1Full },
+	{ 7, 6, -1, { not_covers(NbE, bit(1), bit(7)) }, FracF2Full },
+	{ 7, 8, -1, { not_covers(NbN, bit(5), bit(7)) }, FracF2Full },
+	{ 2, 13, -1, { not_covers(NbS, bit(1), bit(3)) }, FracF1Full },
+	{ 2, 11, -1, { not_covers(NbS, bit(3), bit(1)) }, FracF1Full },
+	{ 2, 11, -1, { not_covers(NbS, bit(3), bit(1)) }, FracF2Full },
+	{ 2, 13, -1, { not_covers(NbS, bit(1), bit(3)) }, FracF2Full },
+	{ 2, 1, -1, { not_covers(NbN, bit(5), bit(7)) }, FracF1Empty },
+	{ 2, 3, -1, { not_covers(NbN, bit(7), bit(5)) }, FracF1Empty },
+	{ 2, 3, -1, { not_covers(NbN, bit(7), bit(5)) }, FracF2Empty },
+	{ 2, 1, -1, { not_covers(NbN, bit(5), bit(7)) }, FracF2Empty },
+	{ 4, 15, -1, { not_covers(NbW, bit(3), bit(5)) }, FracF1Full },
+	{ 4, 13, -1, { not_covers(NbW, bit(5), bit(3)) }, FracF1Full },
+	{ 4, 13, -1, { not_covers(NbW, bit(5), bit(3)) }, FracF2Full },
+	{ 4, 15, -1, { not_covers(NbW, bit(3), bit(5)) }, FracF2Full },
+	{ 4, 3, -1, { not_covers(NbE, bit(7), bit(1)) }, FracF1Empty },
+	{ 4, 5, -1, { not_covers(NbE, bit(1), bit(7)) }, FracF1Empty },
+	{ 4, 5, -1, { not_covers(NbE, bit(1), bit(7)) }, FracF2Empty },
+	{ 4, 3, -1, { not_covers(NbE, bit(7), bit(1)) }, FracF2Empty },
+	{ 6, 17, -1, { not_covers(NbN, bit(7), bit(5)) }, FracF1Full },
+	{ 6, 15, -1, { not_covers(NbN, bit(5), bit(7)) }, FracF1Full },
+	{ 6, 15, -1, { not_covers(NbN, bit(5), bit(7)) }, FracF2Full },
+	{ 6, 17, -1, { not_covers(NbN, bit(7), bit(5)) }, FracF2Full },
+	{ 6, 5, -1, { not_covers(NbS, bit(1), bit(3)) }, FracF1Empty },
+	{ 6, 7, -1, { not_covers(NbS, bit(3), bit(1)) }, FracF1Empty },
+	{ 6, 7, -1, { not_covers(NbS, bit(3), bit(1)) }, FracF2Empty },
+	{ 6, 5, -1, { not_covers(NbS, bit(1), bit(3)) }, FracF2Empty },
+	{ 8, 11, -1, { not_covers(NbE, bit(7), bit(1)) }, FracF1Full },
+	{ 8, 17, -1, { not_covers(NbE, bit(1), bit(7)) }, FracF1Full },
+	{ 8, 17, -1, { not_covers(NbE, bit(1), bit(7)) }, FracF2Full },
+	{ 8, 11, -1, { not_covers(NbE, bit(7), bit(1)) }, FracF2Full },
+	{ 8, 7, -1, { not_covers(NbW, bit(3), bit(5)) }, FracF1Empty },
+	{ 8, 1, -1, { not_covers(NbW, bit(5), bit(3)) }, FracF1Empty },
+	{ 8, 1, -1, { not_covers(NbW, bit(5), bit(3)) }, FracF2Empty },
+	{ 8, 7, -1, { not_covers(NbW, bit(3), bit(5)) }, FracF2Empty },
+	{ 11, 8, -1, { not_covers(NbE, bit(7), bit(1)) }, FracF1Empty },
+	{ 11, 2, -1, { not_covers(NbS, bit(3), bit(1)) }, FracF1Empty },
+	{ 11, 2, -1, { not_covers(NbS, bit(3), bit(1)) }, FracF2Empty },
+	{ 11, 8, -1, { not_covers(NbE, bit(7), bit(1)) }, FracF2Empty },
+	{ 13, 2, -1, { not_covers(NbS, bit(1), bit(3)) }, FracF1Empty },
+	{ 13, 4, -1, { not_covers(NbW, bit(5), bit(3)) }, FracF1Empty },
+	{ 13, 4, -1, { not_covers(NbW, bit(5), bit(3)) }, FracF2Empty },
+	{ 13, 2, -1, { not_covers(NbS, bit(1), bit(3)) }, FracF2Empty },
+	{ 15, 4, -1, { not_covers(NbW, bit(3), bit(5)) }, FracF1Empty },
+	{ 15, 6, -1, { not_covers(NbN, bit(7), bit(5)) }, FracF1Empty },
+	{ 15, 6, -1, { not_covers(NbN, bit(7), bit(5)) }, FracF2Empty },
+	{ 15, 4, -1, { not_covers(NbW, bit(3), bit(5)) }, FracF2Empty },
+	{ 17, 6, -1, { not_covers(NbN, bit(5), bit(7)) }, FracF1Empty },
+	{ 17, 8, -1, { not_covers(NbE, bit(1), bit(7)) }, FracF1Empty },
+	{ 17, 8, -1, { not_covers(NbE, bit(1), bit(7)) }, FracF2Empty },
+	{ 17, 6, -1, { not_covers(NbN, bit(5), bit(7)) }, FracF2Empty },
+};
+
+static constexpr Gray2Vec_RuleIndex NeighborsAdjust2Index = make_rule_index(NeighborsAdjust2Rules);
+
+inline bool Gray2Vec_Grid::apply_rules(const Gray2Vec_Rule *Rules, const Gray2Vec_RuleIndex &Index, const int px, const int py)
+{
+	const int n = m_img_n(px,py);
+	const int first = Index.first[n];
+	const int count = Index.count[n];
 
-	if (!file_c.empty())
-	{
-		if (m_debug)  m_img_s.save("debug-so.tif");
+	if (count == 0) return false;
 
-		std::fprintf(stderr,"Loading combined image data...\n");
+	const unsigned short Cover[4] = {
+		StateTable.cover[m_img_n.state(px,py-1)],
+		StateTable.cover[m_img_n.state(px+1,py)],
+		StateTable.cover[m_img_n.state(px,py+1)],
+		StateTable.cover[m_img_n.state(px-1,py)] };
 
-		GDALDataset  *poDataset2;
+	int Frac = FracAny;
 
-		poDataset2 = static_cast<GDALDataset *>(GDALOpen( file_c.c_str(), GA_ReadOnly ));
+	for (int r = first; r < first+count; r++)
+	{
+		const Gray2Vec_Rule &Rule = Rules[r];
 
-		if (poDataset2 == NULL)
+		if (Rule.frac != FracAny)
 		{
-			std::fprintf(stderr,"  opening file %s failed.\n\n", file_c.c_str());
-			std::exit(1);
+			// past the group of the precondition that holds
+			if (Frac != FracAny)
+			{
+				if (Rule.frac != Frac) return false;
+			}
+			else if (!fraction_holds(Rule.frac, m_img_f1(px,py), m_img_f2(px,py)))
+				continue;
+
+			Frac = Rule.frac;
 		}
 
-		GDALRasterBand  *poBand2;
-		poBand2 = poDataset2->GetRasterBand(1);
+		bool Match = true;
 
-		CImg<unsigned char> img_c = CImg<unsigned char>(nXSize, nYSize, 1, 1);
+		for (int t = 0; t < 3; t++)
+			Match = Match && (((Cover[Rule.terms[t].nb] & Rule.terms[t].sel) == Rule.terms[t].val) != Rule.terms[t].ne);
 
-		if (poBand2->RasterIO(GF_Read, 0, 0, nXSize, nYSize, img_c.data(), nXSize, nYSize, GDT_Byte, 0, 0) != CE_None)
+		if (Match && (Rule.full >= 0))
 		{
-			std::fprintf(stderr,"  error reading image data from file %s.\n\n", file_c.c_str());
-			std::exit(1);
+			static const int dx[4] = { 0, 1, 0, -1 };
+			static const int dy[4] = { -1, 0, 1, 0 };
+			Match = (m_img_s(px+dx[Rule.full],py+dy[Rule.full]) == 255);
 		}
 
-		std::fprintf(stderr,"Processing partical pixels...\n");
-
-		cimg_forXY(m_img_s,px,py)
+		if (Match)
 		{
-			if (Complement)
-				m_img_s(px,py) = 0.25*(img_c(px*2,py*2)+img_c(px*2+1,py*2)+img_c(px*2,py*2+1)+img_c(px*2+1,py*2+1)) - m_img_s(px,py);
-
-			// partial pixels are set to a value that - in combination with the rest
-			// of the combined data approximate the target background value to avoid 
-			// the background shining through with AGG type renderers
-			if (m_img_s(px,py) != 0)
-				if (m_img_s(px,py) != 255)
-				{
-					int fc = 0.25*(img_c(px*2,py*2)+img_c(px*2+1,py*2)+img_c(px*2,py*2+1)+img_c(px*2+1,py*2+1));
-					if (fc > m_img_s(px,py))
-						m_img_s(px,py) = 255*(1.0 - (1.0-fc/255.0)/(1.0-(fc-m_img_s(px,py))/255.0));
-				}
+			m_img_n(px,py) = Rule.result;
+			return true;
 		}
 	}
-}
-
-void Gray2Vec_Grid::Analyze()
-{
-	std::fprintf(stderr,"Determining sides...\n");
-
-	cimg_forXY(m_img_s,px,py)
-	{
-		m_img_n(px,py) = 0;
-
-		if (m_img_s(px,py) != 0)
-			if (m_img_s(px,py) == 255)
-				m_img_n(px,py) = 255;
-			else
-			{
-				// small fractions: use highest value corner
-				if (m_img_s(px,py) < 255/3)
-				{
-					if (m_img(px*2,py*2) > m_img(px*2+1,py*2))
-					{
-						if (m_img(px*2,py*2) > m_img(px*2,py*2+1))
-						{
-							if (m_img(px*2,py*2) > m_img(px*2+1,py*2+1))
-								m_img_n(px,py) = 1;
-							else
-								m_img_n(px,py) = 5;
-						}
-						else
-						{
-							if (m_img(px*2,py*2+1) > m_img(px*2+1,py*2+1))
-								m_img_n(px,py) = 7;
-							else
-								m_img_n(px,py) = 5;
-						}
-					}
-					else
-					{
-						if (m_img(px*2+1,py*2) > m_img(px*2,py*2+1))
-						{
-							if (m_img(px*2+1,py*2) > m_img(px*2+1,py*2+1))
-								m_img_n(px,py) = 3;
-							else
-								m_img_n(px,py) = 5;
-						}
-						else
-						{
-							if (m_img(px*2,py*2+1) > m_img(px*2+1,py*2+1))
-								m_img_n(px,py) = 7;
-							else
-								m_img_n(px,py) = 5;
-						}
-					}
-				}
-				// big fractions: use highest value corner
-				else if (m_img_s(px,py) > 2*255/3)
-				{
-					if (m_img(px*2,py*2) > m_img(px*2+1,py*2))
-					{
-						if (m_img(px*2,py*2) > m_img(px*2,py*2+1))
-						{
-							if (m_img(px*2,py*2) > m_img(px*2+1,py*2+1))
-								m_img_n(px,py) = 11;
-							else
-								m_img_n(px,py) = 15;
-						}
-						else
-						{
-							if (m_img(px*2,py*2+1) > m_img(px*2+1,py*2+1))
-								m_img_n(px,py) = 17;
-							else
-								m_img_n(px,py) = 15;
-						}
-					}
-					else
-					{
-						if (m_img(px*2+1,py*2) > m_img(px*2,py*2+1))
-						{
-							if (m_img(px*2+1,py*2) > m_img(px*2+1,py*2+1))
-								m_img_n(px,py) = 13;
-							else
-								m_img_n(px,py) = 15;
-						}
-						else
-						{
-							if (m_img(px*2,py*2+1) > m_img(px*2+1,py*2+1))
-								m_img_n(px,py) = 17;
-							else
-								m_img_n(px,py) = 15;
-						}
-					}
-				}
-				// medium fractions: use highest value side
-				else if (m_img_s(px,py) <= 2*255/3)
-				{
-					int s2 = m_img(px*2,py*2) + m_img(px*2+1,py*2);
-					int s4 = m_img(px*2+1,py*2+1) + m_img(px*2+1,py*2);
-					int s6 = m_img(px*2+1,py*2+1) + m_img(px*2,py*2+1);
-					int s8 = m_img(px*2,py*2) + m_img(px*2,py*2+1);
 
-					if (s2 > s4)
-					{
-						if (s2 > s6)
-						{
-							if (s2 > s8)
-								m_img_n(px,py) = 2;
-							else
-								m_img_n(px,py) = 8;
-						}
-						else
-						{
-							if (s6 > s8)
-								m_img_n(px,py) = 6;
-							else
-								m_img_n(px,py) = 8;
-						}
-					}
-					else
-					{
-						if (s4 > s6)
-						{
-							if (s4 > s8)
-								m_img_n(px,py) = 4;
-							else
-								m_img_n(px,py) = 8;
-						}
-						else
-						{
-							if (s6 > s8)
-								m_img_n(px,py) = 6;
-							else
-								m_img_n(px,py) = 8;
-						}
-					}
-				}
-			}
-	}
+	return false;
 }
 
-void Gray2Vec_Grid::NeighborsAdjust()
+void Gray2Vec_Grid::OptimizeSidesRow(const int py, const int x0, const int x1, const int dx)
 {
-	std::fprintf(stderr,"Optimizing sides...\n");
-
 	// change corners to sides depending on neighbors
 
-	cimg_forXY(m_img_s,px,py)
+	for (int px = x0; px < x1; px += dx)
 	{
 		if (px > 0)
 			if (py > 0)
 				if (px < m_img_s.width()-1)
 					if (py < m_img_s.height()-1)
 					{
-						switch (m_img_n(px,py))
-						{
-							case 1:
-								if (m_img_s(px,py) > 255/6)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 6) && Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1))
-										m_img_n(px,py) = 2;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 4) && Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1))
-										m_img_n(px,py) = 8;
-								}
-								break;
-							case 3:
-								if (m_img_s(px,py) > 255/6)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 6) && Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3))
-										m_img_n(px,py) = 2;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 8) && Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3))
-										m_img_n(px,py) = 4;
-								}
-								break;
-							case 5:
-								if (m_img_s(px,py) > 255/6)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 6) && Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5))
-										m_img_n(px,py) = 6;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 4) && Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5))
-										m_img_n(px,py) = 4;
-								}
-								break;
-							case 7:
-								if (m_img_s(px,py) > 255/6)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 4) && Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7))
-										m_img_n(px,py) = 8;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 2) && Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7))
-										m_img_n(px,py) = 6;
-								}
-								break;
-						}
+						if (m_img_s(px,py) > 255/6)
+							apply_rules(OptimizeSidesRules, OptimizeSidesIndex, px, py);
 					}
 	}
+}
 
-	std::fprintf(stderr,"Smoothing edges...\n");
-
-	cimg_forXY(m_img_s,px,py)
+void Gray2Vec_Grid::SmoothEdgesRow(const int py, const int x0, const int x1, const int dx)
+{
+	for (int px = x0; px < x1; px += dx)
 	{
 		if (px > 0)
 			if (py > 0)
 				if (px < m_img_s.width()-1)
 					if (py < m_img_s.height()-1)
 					{
-						switch (m_img_n(px,py))
-						{
-							case 1:
-								{
-									if ((m_img_s(px-1,py) == 255) && Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1))
-										m_img_n(px,py) = 8;
-									else if ((m_img_s(px,py-1) == 255) && Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1))
-										m_img_n(px,py) = 2;
-								}
-								break;
-							case 3:
-								{
-									if ((m_img_s(px,py-1) == 255) && Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3))
-										m_img_n(px,py) = 2;
-									else if ((m_img_s(px+1,py) == 255) && Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3))
-										m_img_n(px,py) = 4;
-								}
-								break;
-							case 5:
-								{
-									if ((m_img_s(px+1,py) == 255) && Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5))
-										m_img_n(px,py) = 4;
-									else if ((m_img_s(px,py+1) == 255) && Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5))
-										m_img_n(px,py) = 6;
-								}
-								break;
-							case 7:
-								{
-									if ((m_img_s(px,py+1) == 255) && Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7))
-										m_img_n(px,py) = 6;
-									else if ((m_img_s(px-1,py) == 255) && Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7))
-										m_img_n(px,py) = 8;
-								}
-								break;
-
-							case 11:
-								{
-									if (!Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) &&
-											!Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) &&
-											!Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5))
-										m_img_n(px,py) = 8;
-									else if (!Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) &&
-													 !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) &&
-													 !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5))
-										m_img_n(px,py) = 2;
-								}
-								break;
-							case 13:
-								{
-									if (!Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) &&
-											!Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) &&
-											!Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7))
-										m_img_n(px,py) = 2;
-									else if (!Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) &&
-													 !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) &&
-													 !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7))
-										m_img_n(px,py) = 4;
-								}
-								break;
-							case 15:
-								{
-									if (!Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) &&
-											!Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) &&
-											!Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1))
-										m_img_n(px,py) = 4;
-									else if (!Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) &&
-													 !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) &&
-													 !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1))
-										m_img_n(px,py) = 6;
-								}
-								break;
-							case 17:
-								{
-									if (!Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) &&
-											!Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) &&
-											!Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3))
-										m_img_n(px,py) = 6;
-									else if (!Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) &&
-													 !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) &&
-													 !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3))
-										m_img_n(px,py) = 8;
-								}
-								break;
-						}
+						apply_rules(SmoothEdgesRules, SmoothEdgesIndex, px, py);
 					}
 	}
 }
@@ -573,11 +2363,15 @@ void Gray2Vec_Grid::NeighborsAdjust()
 
 void Gray2Vec_Grid::ResolveConflicts()
 {
-	std::fprintf(stderr,"Resolving conflicts (1)...\n");
-
-	size_t cnt1 = 0;
+	std::vector<Gray2Vec_Step> Steps;
+	Steps.push_back(Gray2Vec_Step(G2V_RESOLVE_CONFLICTS1));
+	Steps.push_back(Gray2Vec_Step(G2V_RESOLVE_CONFLICTS2));
+	Process(Steps);
+}
 
-	cimg_forXY(m_img_s,px,py)
+void Gray2Vec_Grid::ResolveConflictsRow1(const int py, const int x0, const int x1, const int dx, Gray2Vec_Stats &Stats, const bool Fractions)
+{
+	for (int px = x0; px < x1; px += dx)
 	{
 		if (px > 0)
 			if (py > 0)
@@ -586,153 +2380,21 @@ void Gray2Vec_Grid::ResolveConflicts()
 					{
 						int n = m_img_n(px,py);
 
-						switch (n)
-						{
-							case 1:
-								if (!Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) && 
-										Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) && 
-										Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1))
-									m_img_n(px,py) = 7;
-								else if (!Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) && 
-												 Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) && 
-												 Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1))
-									m_img_n(px,py) = 3;
-								break;
-							case 3:
-								if (!Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) && 
-										Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) && 
-										Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3))
-									m_img_n(px,py) = 1;
-								else if (!Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) && 
-												 Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) && 
-												 Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3))
-									m_img_n(px,py) = 5;
-								break;
-							case 5:
-								if (!Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) && 
-										Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) && 
-										Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5))
-									m_img_n(px,py) = 3;
-								else if (!Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) && 
-												 Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) && 
-												 Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5))
-									m_img_n(px,py) = 7;
-								break;
-							case 7:
-								if (!Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) && 
-										Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) && 
-										Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7))
-									m_img_n(px,py) = 5;
-								else if (!Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) && 
-												 Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) && 
-												 Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7))
-									m_img_n(px,py) = 1;
-								break;
-								
-							case 15:
-								if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1))
-									m_img_n(px,py) = 13;
-								else if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1))
-									m_img_n(px,py) = 17;
-								break;
-							case 17:
-								if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3))
-									m_img_n(px,py) = 15;
-								else if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3))
-									m_img_n(px,py) = 11;
-								break;
-							case 11:
-								if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5))
-									m_img_n(px,py) = 17;
-								else if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5))
-									m_img_n(px,py) = 13;
-								break;
-							case 13:
-								if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7))
-									m_img_n(px,py) = 11;
-								else if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7))
-									m_img_n(px,py) = 15;
-								break;
-							case 2:
-								if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) && 
-										(Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7)) && 
-										(Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1)))
-									m_img_n(px,py) = 4;
-								else if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) && 
-												 (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5)) && 
-												 (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 3)))
-									m_img_n(px,py) = 8;
-
-								break;
-							case 6:
-								if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) && 
-										(Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7)) && 
-										(Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1)))
-									m_img_n(px,py) = 4;
-								else if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) && 
-												 (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5)) && 
-												 (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 3)))
-									m_img_n(px,py) = 8;
-								break;
-							case 4:
-								if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) && 
-										(Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3)) && 
-										(Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1)))
-									m_img_n(px,py) = 6;
-								else if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) && 
-												 (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5)) && 
-												 (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7)))
-									m_img_n(px,py) = 2;
-								break;
-							case 8:
-								if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) && 
-										(Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3)) && 
-										(Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1)))
-									m_img_n(px,py) = 6;
-								else if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) && 
-												 (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5)) && 
-												 (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7)))
-									m_img_n(px,py) = 2;
-								break;
-						}
+						apply_rules(ResolveConflicts1Rules, ResolveConflicts1Index, px, py);
+
 						if (n != m_img_n(px,py))
 						{
-							if (m_img_f1.width() > 0)
+							if (Fractions)
 								set_fraction(px,py);
-							cnt1++;
+							Stats.cnt_changed++;
 						}
 					}
 	}
+}
 
-	std::fprintf(stderr,"Resolving conflicts (2)...\n");
-
-	size_t cnt2 = 0;
-
-	cimg_forXY(m_img_s,px,py)
+void Gray2Vec_Grid::ResolveConflictsRow2(const int py, const int x0, const int x1, const int dx, Gray2Vec_Stats &Stats, const bool Fractions)
+{
+	for (int px = x0; px < x1; px += dx)
 	{
 		if (px > 0)
 			if (py > 0)
@@ -740,427 +2402,141 @@ void Gray2Vec_Grid::ResolveConflicts()
 					if (py < m_img_s.height()-1)
 					{
 						int n = m_img_n(px,py);
-						switch (n)
-						{
-							case 1:
-								if (!Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) && 
-										Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3))
-									m_img_n(px,py) = 7;
-								else if (!Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) && 
-												 Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7))
-									m_img_n(px,py) = 3;
-								break;
-							case 3:
-								if (!Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) && 
-										Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5))
-									m_img_n(px,py) = 1;
-								else if (!Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) && 
-												 Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1))
-									m_img_n(px,py) = 5;
-								break;
-							case 5:
-								if (!Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) && 
-										Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7))
-									m_img_n(px,py) = 3;
-								else if (!Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) && 
-												 Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3))
-									m_img_n(px,py) = 7;
-								break;
-							case 7:
-								if (!Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) && 
-										Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1))
-									m_img_n(px,py) = 5;
-								else if (!Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) && 
-												 Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5))
-									m_img_n(px,py) = 1;
-								break;
-								
-							case 15:
-								if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) && 
-										Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3))
-									m_img_n(px,py) = 13;
-								else if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) && 
-												 Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7))
-									m_img_n(px,py) = 17;
-								break;
-							case 17:
-								if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) && 
-										Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5))
-									m_img_n(px,py) = 15;
-								else if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) && 
-												 Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1))
-									m_img_n(px,py) = 11;
-								break;
-							case 11:
-								if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) && 
-										Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7))
-									m_img_n(px,py) = 17;
-								else if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) && 
-												 Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3))
-									m_img_n(px,py) = 13;
-								break;
-							case 13:
-								if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) && 
-										!Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) && 
-										Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1))
-									m_img_n(px,py) = 11;
-								else if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) && 
-												 Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5))
-									m_img_n(px,py) = 15;
-								break;
-
-							case 2:
-								if ((Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) && 
-										 !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3)) ||
-										(Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) && 
-										 !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1)))
-									if (!((Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5)) ||
-												(Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7))))
-										m_img_n(px,py) = 6;
-								break;
-							case 6:
-								if ((Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) && 
-										 !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5)) ||
-										(Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) && 
-										 !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7)))
-									if (!((Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3)) ||
-												(Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1))))
-										m_img_n(px,py) = 2;
-								break;
-							case 4:
-								if ((Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) && 
-										 !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5)) ||
-										(Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) && 
-										 !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3)))
-									if (!((Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7)) ||
-												(Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1))))
-										m_img_n(px,py) = 8;
-								break;
-							case 8:
-								if ((Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) && 
-										 !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7)) ||
-										(Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) && 
-										 !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1))) 
-									if (!((Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5)) ||
-												(Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) && 
-												 !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3))))
-										m_img_n(px,py) = 4;
-								break;
 
-						}
+						apply_rules(ResolveConflicts2Rules, ResolveConflicts2Index, px, py);
+
 						if (n != m_img_n(px,py))
 						{
-							if (m_img_f1.width() > 0)
+							if (Fractions)
 								set_fraction(px,py);
-							cnt2++;
+							Stats.cnt_changed++;
 						}
 					}
 	}
-
-	std::fprintf(stderr,"  changed %ld + %ld pixels\n", cnt1, cnt2);
 }
 
 
 void Gray2Vec_Grid::NeighborsAdjust2()
 {
-	std::fprintf(stderr,"Adjusting pixel types...\n");
+	std::vector<Gray2Vec_Step> Steps;
+	Steps.push_back(Gray2Vec_Step(G2V_ADJUST_TYPES));
+	Process(Steps);
+}
 
+void Gray2Vec_Grid::NeighborsAdjust2Row(const int py, const int x0, const int x1, const int dx, Gray2Vec_Stats &Stats)
+{
 	// change corners to sides depending on neighbors
 
-	size_t cnt = 0;
-
-	cimg_forXY(m_img_s,px,py)
+	for (int px = x0; px < x1; px += dx)
 	{
 		if (px > 0)
 			if (py > 0)
 				if (px < m_img_s.width()-1)
 					if (py < m_img_s.height()-1)
 					{
-						int n = m_img_n(px,py);
-						switch (n)
-						{
-							case 1:
-								if (m_img_f1(px,py) == 255)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7))
-										m_img_n(px,py) = 2;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3))
-										m_img_n(px,py) = 8;									
-								}
-								else if (m_img_f2(px,py) == 255)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3))
-										m_img_n(px,py) = 8;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7))
-										m_img_n(px,py) = 2;
-								}
-								break;
-							case 3:
-								if (m_img_f1(px,py) == 255)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1))
-										m_img_n(px,py) = 4;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5))
-										m_img_n(px,py) = 2;
-								}
-								else if (m_img_f2(px,py) == 255)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5))
-										m_img_n(px,py) = 2;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1))
-										m_img_n(px,py) = 4;
-								}
-								break;
-							case 5:
-								if (m_img_f1(px,py) == 255)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3))
-										m_img_n(px,py) = 6;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7))
-										m_img_n(px,py) = 4;
-								}
-								else if (m_img_f2(px,py) == 255)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7))
-										m_img_n(px,py) = 4;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3))
-										m_img_n(px,py) = 6;
-								}
-								break;
-							case 7:
-								if (m_img_f1(px,py) == 255)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5))
-										m_img_n(px,py) = 8;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1))
-										m_img_n(px,py) = 6;
-								}
-								else if (m_img_f2(px,py) == 255)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1))
-										m_img_n(px,py) = 6;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5))
-										m_img_n(px,py) = 8;
-								}
-								break;
-
-							case 2:
-								if (m_img_f1(px,py) == 255)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1))
-										m_img_n(px,py) = 13;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3))
-										m_img_n(px,py) = 11;									
-								}
-								else if (m_img_f2(px,py) == 255)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3))
-										m_img_n(px,py) = 11;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1))
-										m_img_n(px,py) = 13;
-								}
-								else if (m_img_f1(px,py) == 0)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5))
-										m_img_n(px,py) = 1;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7))
-										m_img_n(px,py) = 3;									
-								}
-								else if (m_img_f2(px,py) == 0)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7))
-										m_img_n(px,py) = 3;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5))
-										m_img_n(px,py) = 1;
-								}
-								break;
-							case 4:
-								if (m_img_f1(px,py) == 255)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3))
-										m_img_n(px,py) = 15;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5))
-										m_img_n(px,py) = 13;									
-								}
-								else if (m_img_f2(px,py) == 255)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5))
-										m_img_n(px,py) = 13;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3))
-										m_img_n(px,py) = 15;
-								}
-								else if (m_img_f1(px,py) == 0)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7))
-										m_img_n(px,py) = 3;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1))
-										m_img_n(px,py) = 5;									
-								}
-								else if (m_img_f2(px,py) == 0)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1))
-										m_img_n(px,py) = 5;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7))
-										m_img_n(px,py) = 3;
-								}
-								break;
-							case 6:
-								if (m_img_f1(px,py) == 255)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7))
-										m_img_n(px,py) = 17;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5))
-										m_img_n(px,py) = 15;									
-								}
-								else if (m_img_f2(px,py) == 255)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5))
-										m_img_n(px,py) = 15;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7))
-										m_img_n(px,py) = 17;
-								}
-								else if (m_img_f1(px,py) == 0)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1))
-										m_img_n(px,py) = 5;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3))
-										m_img_n(px,py) = 7;									
-								}
-								else if (m_img_f2(px,py) == 0)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3))
-										m_img_n(px,py) = 7;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1))
-										m_img_n(px,py) = 5;
-								}
-								break;
-							case 8:
-								if (m_img_f1(px,py) == 255)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7))
-										m_img_n(px,py) = 11;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1))
-										m_img_n(px,py) = 17;									
-								}
-								else if (m_img_f2(px,py) == 255)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1))
-										m_img_n(px,py) = 17;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7))
-										m_img_n(px,py) = 11;
-								}
-								else if (m_img_f1(px,py) == 0)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3))
-										m_img_n(px,py) = 7;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5))
-										m_img_n(px,py) = 1;									
-								}
-								else if (m_img_f2(px,py) == 0)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5))
-										m_img_n(px,py) = 1;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3))
-										m_img_n(px,py) = 7;
-								}
-								break;
-
-							case 11:
-								if (m_img_f1(px,py) == 0)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7))
-										m_img_n(px,py) = 8;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3))
-										m_img_n(px,py) = 2;
-								}
-								else if (m_img_f2(px,py) == 0)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3))
-										m_img_n(px,py) = 2;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7))
-										m_img_n(px,py) = 8;
-								}
-								break;
-							case 13:
-								if (m_img_f1(px,py) == 0)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1))
-										m_img_n(px,py) = 2;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5))
-										m_img_n(px,py) = 4;
-								}
-								else if (m_img_f2(px,py) == 0)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5))
-										m_img_n(px,py) = 4;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 3) || !Gray2Vec_Grid::check_cover(m_img_n(px,py+1), 1))
-										m_img_n(px,py) = 2;
-								}
-								break;
-							case 15:
-								if (m_img_f1(px,py) == 0)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3))
-										m_img_n(px,py) = 4;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7))
-										m_img_n(px,py) = 6;
-								}
-								else if (m_img_f2(px,py) == 0)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7))
-										m_img_n(px,py) = 6;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 5) || !Gray2Vec_Grid::check_cover(m_img_n(px-1,py), 3))
-										m_img_n(px,py) = 4;
-								}
-								break;
-							case 17:
-								if (m_img_f1(px,py) == 0)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5))
-										m_img_n(px,py) = 6;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1))
-										m_img_n(px,py) = 8;
-								}
-								else if (m_img_f2(px,py) == 0)
-								{
-									if (Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px+1,py), 1))
-										m_img_n(px,py) = 8;
-									else if (Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 7) || !Gray2Vec_Grid::check_cover(m_img_n(px,py-1), 5))
-										m_img_n(px,py) = 6;
-								}
-								break;
-						}
-						if (n != m_img_n(px,py))
+						if (apply_rules(NeighborsAdjust2Rules, NeighborsAdjust2Index, px, py))
 						{
 							set_fraction(px,py);
-							cnt++;
+							Stats.cnt_changed++;
 						}
 					}
 	}
+}
+
+/// fractions of the pixel classes in fixed point: the square roots needed for
+/// the corners are tabulated for the 256 pixel values, all other operations
+/// are exact in integers (including the conversions of the former floating
+/// point formulas to unsigned char and short)
+struct Gray2Vec_FractionTable
+{
+	Gray2Vec_FractionTable()
+	{
+		for (int s = 0; s < 256; s++)
+		{
+			const double r = std::sqrt(s*255.0*2);
+			const double r2 = std::sqrt(((255-s)*255.0)*2);
+			// initial fractions, converted like the original formulas
+			corner[s] = r;
+			corner2[s] = 255-r2;
+			root[s] = std::floor(r);
+			root2[s] = std::floor(r2);
+			root2_up[s] = std::ceil(r2);
+		}
+	}
+
+	/// initial fractions of small and large corners with pixel value s
+	unsigned char corner[256];
+	unsigned char corner2[256];
+	/// square root of 2*255*s rounded down, of 2*255*(255-s) rounded down and up
+	short root[256];
+	short root2[256];
+	short root2_up[256];
+};
+
+static const Gray2Vec_FractionTable FractionTable;
+
+/// coverage errors of the pixel classes as numerators, the error in pixel
+/// values is obtained by dividing by the denominator ErrorCorner and so on
+static const int ErrorCorner = 2*255;
+static const int ErrorCornerAdjust = 2*255*255;
+static const int ErrorSide = 2;
+static const int ErrorSideAdjust = 4;
+
+/// corner: 0.5*f1*f2/255 - s, with adjust 0.5*f1*f2*f3/(255*255) - s
+static inline int corner_error(const int s, const int f1, const int f2) { return f1*f2 - ErrorCorner*s; }
+static inline long long corner_error(const int s, const int f1, const int f2, const int f3) { return (long long)(f1*f2)*f3 - (long long)ErrorCornerAdjust*s; }
+/// side: (f1+f2)*0.5 - s, with adjust (2*f3+f1+f2)*0.25 - s
+static inline int side_error(const int s, const int f1, const int f2) { return f1 + f2 - ErrorSide*s; }
+static inline int side_error(const int s, const int f1, const int f2, const int f3) { return 2*f3 + f1 + f2 - ErrorSideAdjust*s; }
+
+/// adjustment factor (f3) bringing the coverage of a corner with
+/// fractions f1/f2 to s (same as the floating point formula, including
+/// the conversion of factors above 32767 to short)
+static inline short corner_adjust(const int s, const int f1, const int f2)
+{
+	if (f1*f2 == 0) return 255;
+	return std::min(ErrorCornerAdjust*s/(f1*f2), 255*255/std::max(f1, f2));
+}
+
+/// limit of the error numerators with denominator Den above which the coverage
+/// is compensated with f3 (error above max_error*255 in pixel values) - if the
+/// limit is an integer the former floating point comparison decides depending
+/// on its rounding, errors at the limit are then checked in floating point
+struct Gray2Vec_ErrorLimit
+{
+	Gray2Vec_ErrorLimit(const double max_error, const int Den)
+	{
+		m_limit = LLONG_MAX;
+		m_tie = -1;
+
+		if (max_error > 0)
+		{
+			const double l = max_error*255*Den;
+			m_limit = std::floor(l);
+			if (std::abs(l - std::floor(l + 0.5)) < 1e-6)
+			{
+				m_limit = std::floor(l + 0.5);
+				m_tie = m_limit;
+			}
+		}
+	}
+
+	/// if error numerator e is at the limit and has to be checked in floating point
+	bool tie(const long long e) const { return (std::abs(e) == m_tie); }
+	/// if error numerator e is above the limit (when no tie)
+	bool above(const long long e) const { return (std::abs(e) > m_limit); }
 
-	std::fprintf(stderr,"  changed %ld pixels\n", cnt);
+	long long m_limit;
+	long long m_tie;
+};
+
+/// 0.75*f + 0.25*(255-sqrt(2*255*(255-s))) rounded towards zero
+static inline int blend_corner2(const int f, const int s)
+{
+	const int a = 3*f + 255;
+	if (a >= FractionTable.root2_up[s])
+		return (a - FractionTable.root2_up[s]) >> 2;
+	return -((FractionTable.root2[s] - a) >> 2);
 }
 
 int Gray2Vec_Grid::set_fraction(const int px, const int py)
@@ -1175,7 +2551,7 @@ int Gray2Vec_Grid::set_fraction(const int px, const int py)
 		case 3:
 		case 5:
 		case 7:
-			m_img_f1(px,py) = std::sqrt(m_img_s(px,py)*255.0*2);
+			m_img_f1(px,py) = FractionTable.corner[m_img_s(px,py)];
 			m_img_f2(px,py) = m_img_f1(px,py);
 			return 1;
 			break;
@@ -1191,7 +2567,7 @@ int Gray2Vec_Grid::set_fraction(const int px, const int py)
 		case 13:
 		case 15:
 		case 17:
-			m_img_f1(px,py) = 255-std::sqrt(((255-m_img_s(px,py))*255.0)*2);
+			m_img_f1(px,py) = FractionTable.corner2[m_img_s(px,py)];
 			m_img_f2(px,py) = m_img_f1(px,py);
 			return 3;
 			break;
@@ -1202,6 +2578,11 @@ int Gray2Vec_Grid::set_fraction(const int px, const int py)
 
 double Gray2Vec_Grid::pixel_error(const int px, const int py, const bool use_adjust)
 {
+	const int s = m_img_s(px,py);
+	const int f1 = m_img_f1(px,py);
+	const int f2 = m_img_f2(px,py);
+	const int f3 = m_img_f3(px,py);
+
 	switch (m_img_n(px,py))
 	{
 		case 1:
@@ -1209,490 +2590,268 @@ double Gray2Vec_Grid::pixel_error(const int px, const int py, const bool use_adj
 		case 5:
 		case 7:
 			if (use_adjust)
-				return 0.5*m_img_f1(px,py)*m_img_f2(px,py)*m_img_f3(px,py)/(255*255) - m_img_s(px,py);
+				return double(corner_error(s, f1, f2, f3))/ErrorCornerAdjust;
 			else
-				return 0.5*m_img_f1(px,py)*m_img_f2(px,py)/255 - m_img_s(px,py);
+				return double(corner_error(s, f1, f2))/ErrorCorner;
 			break;
 		case 2:
 		case 4:
 		case 6:
 		case 8:
 			if (use_adjust)
-				return (2.0*m_img_f3(px,py)+m_img_f1(px,py)+m_img_f2(px,py))*0.25 - m_img_s(px,py);
+				return double(side_error(s, f1, f2, f3))/ErrorSideAdjust;
 			else
-				return (m_img_f1(px,py)+m_img_f2(px,py))*0.5 - m_img_s(px,py);
+				return double(side_error(s, f1, f2))/ErrorSide;
 			break;
 		case 11:
 		case 13:
 		case 15:
 		case 17:
 			if (use_adjust)
-				return 0.5*(255-m_img_f1(px,py))*(255-m_img_f2(px,py))*m_img_f3(px,py)/(255*255) - (255-m_img_s(px,py));
+				return double(corner_error(255-s, 255-f1, 255-f2, f3))/ErrorCornerAdjust;
 			else
-				return 0.5*(255-m_img_f1(px,py))*(255-m_img_f2(px,py))/255 - (255-m_img_s(px,py));
+				return double(corner_error(255-s, 255-f1, 255-f2))/ErrorCorner;
 			break;
 	}
+
+	return 0.0;
 }
 
 
 void Gray2Vec_Grid::InitFractions()
 {
-	std::fprintf(stderr,"Determining initial fractions...\n");
-
-	// fractions apply clockwise to the pixel sides
-	m_img_f1 = CImg<unsigned char>(m_img.width()/2, m_img.height()/2, 1, 1);
-	m_img_f2 = CImg<unsigned char>(m_img.width()/2, m_img.height()/2, 1, 1);
-	m_img_f3 = CImg<short>(m_img.width()/2, m_img.height()/2, 1, 1);
-
-	size_t cnt_all = 0;
-	size_t cnt_corner = 0;
-	size_t cnt_side = 0;
-	size_t cnt_corner2 = 0;
+	std::vector<Gray2Vec_Step> Steps;
+	Steps.push_back(Gray2Vec_Step(G2V_INIT_FRACTIONS));
+	Process(Steps);
+}
 
-	cimg_forXY(m_img_s,px,py)
+void Gray2Vec_Grid::InitFractionsRow(const int py, const int x0, const int x1, Gray2Vec_Stats &Stats)
+{
+	for (int px = x0; px < x1; px++)
 	{
-		cnt_all++;
+		Stats.cnt_all++;
 
 		switch (set_fraction(px,py))
 		{
 			case 1:
-				cnt_corner++;
+				Stats.cnt_corner++;
 				break;
 			case 2:
-				cnt_side++;
+				Stats.cnt_side++;
 				break;
 			case 3:
-				cnt_corner2++;
+				Stats.cnt_corner2++;
 				break;
 		}
 	}
-
-	std::fprintf(stderr,"  %ld side, %ld + %ld corner of %ld pixels\n", cnt_side, cnt_corner, cnt_corner2, cnt_all);
 }
 
 void Gray2Vec_Grid::TuneFractions(const double max_error)
 {
-	std::fprintf(stderr,"Tuning fractions...\n");
-
-	double f;
-	double df;
-
-	double df_max = 0.0;
-	double df_sum = 0.0;
-	size_t df_cnt = 0;
+	std::vector<Gray2Vec_Step> Steps;
+	Steps.push_back(Gray2Vec_Step(G2V_TUNE_FRACTIONS, max_error));
+	Process(Steps);
+}
 
-	size_t cnt_all = 0;
-	size_t cnt_corner = 0;
-	size_t cnt_corner_n = 0;
-	size_t cnt_corner_s = 0;
-	size_t cnt_side = 0;
-	size_t cnt_side_n = 0;
-	size_t cnt_side_s = 0;
-	size_t cnt_corner2 = 0;
-	size_t cnt_corner2_n = 0;
-	size_t cnt_corner2_s = 0;
-	size_t cnt_changed = 0;
-	size_t cnt_changed2 = 0;
-	size_t cnt_changed_type = 0;
+void Gray2Vec_Grid::TuneFractionsRow(const int py, const int x0, const int x1, const double max_error, Gray2Vec_Stats &Stats)
+{
+	const Gray2Vec_ErrorLimit LimitCorner(max_error, ErrorCorner);
+	const Gray2Vec_ErrorLimit LimitSide(max_error, ErrorSide);
 
-	CImg<unsigned char> img_e = CImg<unsigned char>(m_img.width()/2, m_img.height()/2, 1, 1);
+	// error numerator before tuning and if it is compensated with f3
+	long long e;
+	bool Compensate;
+	double df;
 
-	cimg_forXY(m_img_s,px,py)
+	// a separate sides_connected() pre-pass writing class and side masks for
+	// vectorized per class kernels was measured and costs more than it saves:
+	// the pre-pass alone takes about half the time of this loop and the kernels
+	// need divisions and table lookups per pixel.
+	for (int px = x0; px < x1; px++)
 	{
-		cnt_all++;
+		Stats.cnt_all++;
 
-		df = pixel_error(px, py, false);
+		const int s = m_img_s(px,py);
+		// the results are stored as unsigned char like with the former floating point formulas
+		unsigned char f1 = m_img_f1(px,py);
+		unsigned char f2 = m_img_f2(px,py);
+		short f3 = -1;
 
 		switch (m_img_n(px,py))
 		{
 			case 1:
-			case 3:
-			case 5:
-			case 7:
-				if ((max_error > 0) && (std::abs(df) > max_error*255))
-				{
-					if (m_img_f1(px,py)*m_img_f2(px,py) > 0)
-						f = double(m_img_s(px,py)*255)/(0.5*m_img_f1(px,py)*m_img_f2(px,py));
-					else
-						f = 1.0;
-
-					double m = 255.0/std::max(m_img_f1(px,py), m_img_f2(px,py));
-					m_img_f3(px,py) = std::min(std::max(f, 0.0), m)*255;
-
-					df = pixel_error(px, py, true);
-
-					df_max = std::max(std::abs(df), df_max);
-					df_sum += std::abs(df);
-					df_cnt++;
-
-					img_e(px,py) = std::abs(df);
+			case 3:
+			case 5:
+			case 7:
+				e = corner_error(s, f1, f2);
+				if (LimitCorner.tie(e))
+					Compensate = (std::abs(0.5*f1*f2/255 - s) > max_error*255);
+				else
+					Compensate = LimitCorner.above(e);
 
-					cnt_changed++;
+				if (Compensate)
+				{
+					f3 = corner_adjust(s, f1, f2);
+					df = double(corner_error(s, f1, f2, f3))/ErrorCornerAdjust;
+					Stats.cnt_changed++;
 				}
 				else
 				{
-					int s = sides_connected(px,py);
+					const int c = sides_connected(px,py);
 
-					if (s == 0)
+					if (c == 0)
 					{
-						m_img_f1(px,py) = std::sqrt(m_img_s(px,py)*255.0*2);
-						m_img_f2(px,py) = m_img_f1(px,py);
-						cnt_corner_n++;
+						f1 = FractionTable.corner[s];
+						f2 = f1;
+						Stats.cnt_corner_n++;
 					}
-					else if (s == 1)
+					else if (c == 1)
 					{
-						if (m_img_f1(px,py) > 0)
-							f = m_img_s(px,py)*255*2/m_img_f1(px,py);
-						else
-							f = m_img_s(px,py)*255*2;
-						if (f > 255.0)
-						{
-							m_img_f2(px,py) = 255;
-						}
-						else
-						{
-							m_img_f2(px,py) = f;
-						}
-						cnt_corner_s++;
+						f2 = std::min(s*255*2/std::max(int(f1), 1), 255);
+						Stats.cnt_corner_s++;
 					}
-					else if (s == 2)
+					else if (c == 2)
 					{
-						if (m_img_f2(px,py) > 0)
-							f = m_img_s(px,py)*255*2/m_img_f2(px,py);
-						else
-							f = m_img_s(px,py)*255*2;
-						if (f > 255.0)
-						{
-							m_img_f1(px,py) = 255;
-						}
-						else
-						{
-							m_img_f1(px,py) = f;
-						}
-						cnt_corner_s++;
+						f1 = std::min(s*255*2/std::max(int(f2), 1), 255);
+						Stats.cnt_corner_s++;
 					}
 					else
 					{
-						m_img_f1(px,py) = 0.75*m_img_f1(px,py) + 0.25*std::sqrt(m_img_s(px,py)*255*2);
-						m_img_f2(px,py) = 0.75*m_img_f2(px,py) + 0.25*std::sqrt(m_img_s(px,py)*255*2);
-						cnt_corner++;
+						// 0.75*f + 0.25*sqrt(2*255*s) rounded down
+						f1 = (3*f1 + FractionTable.root[s]) >> 2;
+						f2 = (3*f2 + FractionTable.root[s]) >> 2;
+						Stats.cnt_corner++;
 					}
 
-					df = pixel_error(px, py, false);
-
-					m_img_f3(px,py) = -1;
-
-					df_max = std::max(std::abs(df), df_max);
-					df_sum += std::abs(df);
-					df_cnt++;
-
-					img_e(px,py) = std::abs(df);
-
+					df = double(corner_error(s, f1, f2))/ErrorCorner;
 				}
-					
 				break;
 			case 2:
 			case 4:
 			case 6:
 			case 8:
-				if ((max_error > 0) && (std::abs(df) > max_error*255))
-				{
-					f = 2.0*(m_img_s(px,py) - 0.25*m_img_f1(px,py)-0.25*m_img_f2(px,py));
-					m_img_f3(px,py) = std::min(std::max(f, 0.0), 255.0);
-
-					df = pixel_error(px, py, true);
-
-					df_max = std::max(std::abs(df), df_max);
-					df_sum += std::abs(df);
-					df_cnt++;
-
-					img_e(px,py) = std::abs(df);
+				e = side_error(s, f1, f2);
+				if (LimitSide.tie(e))
+					Compensate = (std::abs((f1+f2)*0.5 - s) > max_error*255);
+				else
+					Compensate = LimitSide.above(e);
 
-					cnt_changed++;
+				if (Compensate)
+				{
+					// 2*(s - 0.25*f1 - 0.25*f2) limited to 0-255
+					f3 = std::min(std::max(4*s - f1 - f2, 0), 2*255) >> 1;
+					df = double(side_error(s, f1, f2, f3))/ErrorSideAdjust;
+					Stats.cnt_changed++;
 				}
 				else
 				{
-					int s = sides_connected(px,py);
+					const int c = sides_connected(px,py);
 
-					if (s == 0)
+					if (c == 0)
 					{
-						m_img_f1(px,py) = m_img_s(px,py);
-						m_img_f2(px,py) = m_img_s(px,py);
-						cnt_side_n++;
+						f1 = s;
+						f2 = s;
+						Stats.cnt_side_n++;
 					}
-					else if (s == 1)
+					else if (c == 1)
 					{
-						f = 2.0*(m_img_s(px,py)-0.5*m_img_f1(px,py));
-						if (f < 0.0)
-						{
-							m_img_f2(px,py) = 0;
-						}
-						else if (f > 255.0)
-						{
-							m_img_f2(px,py) = 255;
-						}
-						else
-						{
-							m_img_f2(px,py) = f;
-						}
-						cnt_side_s++;
+						f2 = std::min(std::max(2*s - f1, 0), 255);
+						Stats.cnt_side_s++;
 					}
-					else if (s == 2)
+					else if (c == 2)
 					{
-						f = 2.0*(m_img_s(px,py)-0.5*m_img_f2(px,py));
-						if (f < 0.0)
-						{
-							m_img_f1(px,py) = 0.0;
-						}
-						else if (f > 255.0)
-						{
-							m_img_f1(px,py) = 255;
-						}
-						else
-						{
-							m_img_f1(px,py) = f;
-						}
-						cnt_side_s++;
+						f1 = std::min(std::max(2*s - f2, 0), 255);
+						Stats.cnt_side_s++;
 					}
 					else
 					{
-						m_img_f1(px,py) = 0.75*m_img_f1(px,py) + 0.25*m_img_s(px,py);
-						m_img_f2(px,py) = 0.75*m_img_f2(px,py) + 0.25*m_img_s(px,py);
-						cnt_side++;
+						f1 = (3*f1 + s) >> 2;
+						f2 = (3*f2 + s) >> 2;
+						Stats.cnt_side++;
 					}
 
-					df = pixel_error(px, py, false);
-
-					m_img_f3(px,py) = -1;
-					df_max = std::max(std::abs(df), df_max);
-					df_sum += std::abs(df);
-					df_cnt++;
-
-					img_e(px,py) = std::abs(df);
+					df = double(side_error(s, f1, f2))/ErrorSide;
 				}
-
 				break;
 			case 11:
 			case 13:
 			case 15:
 			case 17:
-				if ((max_error > 0) && (std::abs(df) > max_error*255))
-				{
-					if ((255-m_img_f1(px,py))*(255-m_img_f2(px,py)) > 0)
-						f = double((255-m_img_s(px,py))*255)/(0.5*(255-m_img_f1(px,py))*(255-m_img_f2(px,py)));
-					else
-						f = 1.0;
-
-					double m = 255.0/std::max((255-m_img_f1(px,py)), (255-m_img_f2(px,py)));
-					m_img_f3(px,py) = std::min(std::max(f, 0.0), m)*255;
-
-					df = pixel_error(px, py, true);
-
-					df_max = std::max(std::abs(df), df_max);
-					df_sum += std::abs(df);
-					df_cnt++;
-
-					img_e(px,py) = std::abs(df);
+				e = corner_error(255-s, 255-f1, 255-f2);
+				if (LimitCorner.tie(e))
+					Compensate = (std::abs(0.5*(255-f1)*(255-f2)/255 - (255-s)) > max_error*255);
+				else
+					Compensate = LimitCorner.above(e);
 
-					cnt_changed2++;
+				if (Compensate)
+				{
+					f3 = corner_adjust(255-s, 255-f1, 255-f2);
+					df = double(corner_error(255-s, 255-f1, 255-f2, f3))/ErrorCornerAdjust;
+					Stats.cnt_changed2++;
 				}
 				else
 				{
-					int s = sides_connected(px,py);
+					const int c = sides_connected(px,py);
 
-					if (s == 0)
+					if (c == 0)
 					{
-						m_img_f1(px,py) = 255-std::sqrt(((255-m_img_s(px,py))*255.0)*2);
-						m_img_f2(px,py) = m_img_f1(px,py);
-						cnt_corner2_n++;
+						f1 = FractionTable.corner2[s];
+						f2 = f1;
+						Stats.cnt_corner2_n++;
 					}
-					else if (s == 1)
+					else if (c == 1)
 					{
-						if (m_img_f1(px,py) < 255)
-							f = 255.0 - (255-m_img_s(px,py))*255*2/(255-m_img_f1(px,py));
-						else
-							f = 255.0 - (255-m_img_s(px,py))*255*2;
-						if (f < 0.0)
-						{
-							m_img_f2(px,py) = 0.0;
-						}
-						else
-						{
-							m_img_f2(px,py) = f;
-						}
-						cnt_corner2_s++;
+						f2 = std::max(255 - (255-s)*255*2/std::max(255-f1, 1), 0);
+						Stats.cnt_corner2_s++;
 					}
-					else if (s == 2)
+					else if (c == 2)
 					{
-						if (m_img_f2(px,py) < 255)
-							f = 255.0 - (255-m_img_s(px,py))*255*2/(255-m_img_f2(px,py));
-						else
-							f = 255.0 - (255-m_img_s(px,py))*255*2;
-						if (f < 0.0)
-						{
-							m_img_f1(px,py) = 0.0;
-						}
-						else
-						{
-							m_img_f1(px,py) = f;
-						}
-						cnt_corner2_s++;
+						f1 = std::max(255 - (255-s)*255*2/std::max(255-f2, 1), 0);
+						Stats.cnt_corner2_s++;
 					}
 					else
 					{
-						m_img_f1(px,py) = 0.75*m_img_f1(px,py) + 0.25*(255-std::sqrt(((255-m_img_s(px,py))*255.0*2)));
-						m_img_f2(px,py) = 0.75*m_img_f2(px,py) + 0.25*(255-std::sqrt(((255-m_img_s(px,py))*255.0*2)));
-						cnt_corner2++;
+						f1 = blend_corner2(f1, s);
+						f2 = blend_corner2(f2, s);
+						Stats.cnt_corner2++;
 					}
 
-					df = pixel_error(px, py, false);
-
-					m_img_f3(px,py) = -1;
-					df_max = std::max(std::abs(df), df_max);
-					df_sum += std::abs(df);
-					df_cnt++;
-
-					img_e(px,py) = std::abs(df);
+					df = double(corner_error(255-s, 255-f1, 255-f2))/ErrorCorner;
 				}
 				break;
 			default:
-				img_e(px,py) = 0;
-				break;
+				m_img_e(px,py) = 0;
+				continue;
 		}
-	}
 
-	if (df_cnt > 0)
-	{
-		std::fprintf(stderr,"  %ld + %ld + %ld side, %ld + %ld + %ld small corner , %ld + %ld + %ld large corner\n", cnt_side, cnt_side_n, cnt_side_s, cnt_corner, cnt_corner_n, cnt_corner_s, cnt_corner2, cnt_corner2_n, cnt_corner2_s);
+		if ((f1 != m_img_f1(px,py)) || (f2 != m_img_f2(px,py)) || (f3 != m_img_f3(px,py))) Stats.cnt_tuned++;
 
-		std::fprintf(stderr,"  maximum error: %.1f, average: %.1f (%.3f), %ld + %ld + %ld changed\n", df_max, df_sum/df_cnt, (df_sum/df_cnt)/255, cnt_changed_type, cnt_changed, cnt_changed2);
-	}
+		m_img_f1(px,py) = f1;
+		m_img_f2(px,py) = f2;
+		m_img_f3(px,py) = f3;
 
-	if (m_debug)  img_e.save("debug-e.tif");
+		Stats.df_max = std::max(std::abs(df), Stats.df_max);
+		Stats.df_sum += std::abs(df);
+		Stats.df_cnt++;
+
+		m_img_e(px,py) = std::abs(df);
+	}
 }
 
 void Gray2Vec_Grid::move_dir(int &px, int &py, const int dir)
 {
-	switch (dir)
-	{
-		case 1:
-			px -= 1;
-			py -= 1;
-			break;
-		case 2:
-			py -= 1;
-			break;
-		case 3:
-			px += 1;
-			py -= 1;
-			break;
-		case 4:
-			px += 1;
-			break;
-		case 5:
-			px += 1;
-			py += 1;
-			break;
-		case 6:
-			py += 1;
-			break;
-		case 7:
-			px -= 1;
-			py += 1;
-			break;
-		case 8:
-			px -= 1;
-			break;
-	}
+	px += DirX[dir];
+	py += DirY[dir];
 }
 
-
-int Gray2Vec_Grid::side1(const int dir)
+int Gray2Vec_Grid::side1(const int st)
 {
-	switch (dir)
-	{
-		case 1:
-			return 2;
-			break;
-		case 2:
-			return 4;
-			break;
-		case 3:
-			return 4;
-			break;
-		case 4:
-			return 6;
-			break;
-		case 5:
-			return 6;
-			break;
-		case 6:
-			return 8;
-			break;
-		case 7:
-			return 8;
-			break;
-		case 8:
-			return 2;
-			break;
-		case 11:
-			return 4;
-			break;
-		case 13:
-			return 6;
-			break;
-		case 15:
-			return 8;
-			break;
-		case 17:
-			return 2;
-			break;
-	}
-	return 0;
+	return StateTable.side1[st];
 }
 
-int Gray2Vec_Grid::side2(const int dir)
+int Gray2Vec_Grid::side2(const int st)
 {
-	switch (dir)
-	{
-		case 1:
-			return 8;
-			break;
-		case 2:
-			return 8;
-			break;
-		case 3:
-			return 2;
-			break;
-		case 4:
-			return 2;
-			break;
-		case 5:
-			return 4;
-			break;
-		case 6:
-			return 4;
-			break;
-		case 7:
-			return 6;
-			break;
-		case 8:
-			return 6;
-			break;
-		case 11:
-			return 6;
-			break;
-		case 13:
-			return 8;
-			break;
-		case 15:
-			return 2;
-			break;
-		case 17:
-			return 4;
-			break;
-	}
-	return 0;
+	return StateTable.side2[st];
 }
 
 
@@ -1708,8 +2867,8 @@ int Gray2Vec_Grid::share_sides(const int px1, const int py1, const int px2, cons
 	if (px2 >= m_img_n.width()) return 0;
 	if (py2 >= m_img_n.height()) return 0;
 
-	int n1 = m_img_n(px1, py1);
-	int n2 = m_img_n(px2, py2);
+	int n1 = m_img_n.state(px1, py1);
+	int n2 = m_img_n.state(px2, py2);
 
 	int s11 = Gray2Vec_Grid::side1(n1);
 	int s12 = Gray2Vec_Grid::side2(n1);
@@ -1750,7 +2909,7 @@ int Gray2Vec_Grid::sides_connected(const int px, const int py)
 	if (px >= m_img_n.width()) return 0;
 	if (py >= m_img_n.height()) return 0;
 
-	int n = m_img_n(px, py);
+	int n = m_img_n.state(px, py);
 
 	int s1 = Gray2Vec_Grid::side1(n);
 	int s2 = Gray2Vec_Grid::side2(n);
@@ -1785,16 +2944,16 @@ int Gray2Vec_Grid::sides_connected(const int px, const int py)
 
 	if (s11 == 0)
 	{
-		s11 = Gray2Vec_Grid::side1(m_img_n(pxn1, pyn1));
-		s12 = Gray2Vec_Grid::side2(m_img_n(pxn1, pyn1));
+		s11 = Gray2Vec_Grid::side1(m_img_n.state(pxn1, pyn1));
+		s12 = Gray2Vec_Grid::side2(m_img_n.state(pxn1, pyn1));
 		if (std::abs(s1-s11) == 4) res += 1;
 		else if (std::abs(s1-s12) == 4) res += 1;
 	}
 
 	if (s21 == 0)
 	{
-		s21 = Gray2Vec_Grid::side1(m_img_n(pxn2, pyn2));
-		s22 = Gray2Vec_Grid::side2(m_img_n(pxn2, pyn2));
+		s21 = Gray2Vec_Grid::side1(m_img_n.state(pxn2, pyn2));
+		s22 = Gray2Vec_Grid::side2(m_img_n.state(pxn2, pyn2));
 		if (std::abs(s2-s21) == 4) res += 2;
 		else if (std::abs(s2-s22) == 4) res += 2;
 	}
@@ -1805,18 +2964,20 @@ int Gray2Vec_Grid::sides_connected(const int px, const int py)
 
 void Gray2Vec_Grid::FractionsNeighborsAdj()
 {
-	std::fprintf(stderr,"Adjusting neighbor fractions to match...\n");
+	std::vector<Gray2Vec_Step> Steps;
+	Steps.push_back(Gray2Vec_Step(G2V_FRACTIONS_NEIGHBORS));
+	Process(Steps);
+}
 
+void Gray2Vec_Grid::FractionsNeighborsAdjRow(const int py, const int x0, const int x1, Gray2Vec_Stats &Stats)
+{
 	// this adjust fractions of neighboring pixels to match
 	// this resolves cases where neighboring pixels have
 	// exactly opposite fractions at their respective sides
 
 	double df;
-	double df_max = 0.0;
-	double df_sum = 0.0;
-	size_t df_cnt = 0;
 
-	cimg_forXY(m_img_s,px,py)
+	for (int px = x0; px < x1; px++)
 	{
 		int nx, ny, nn, avg;
 
@@ -1825,209 +2986,51 @@ void Gray2Vec_Grid::FractionsNeighborsAdj()
 			nx = px + x4[i];
 			ny = py + y4[i];
 
+			if ((ny < py) || ((ny == py) && (nx < px))) continue;
+
 			nn = Gray2Vec_Grid::share_sides(px, py, nx, ny);
 
-			switch (nn)
-			{
-				case 11:
-					avg = (m_img_f1(px,py) + m_img_f1(nx,ny))/2;
-
-					df = avg - m_img_f1(px,py);
-					df_max = std::max(std::abs(df), df_max);
-					df_sum += std::abs(df);
-					df_cnt++;
-
-					m_img_f1(px,py) = (m_img_f1(px,py)+avg)/2;
-
-					df = avg - m_img_f1(nx,ny);
-					df_max = std::max(std::abs(df), df_max);
-					df_sum += std::abs(df);
-					df_cnt++;
-
-					m_img_f1(nx,ny) = (m_img_f1(nx,ny)+avg)/2;
-					break;
-
-				case 12:
-					avg = (m_img_f1(px,py) + m_img_f2(nx,ny))/2;
-
-					df = avg - m_img_f1(px,py);
-					df_max = std::max(std::abs(df), df_max);
-					df_sum += std::abs(df);
-					df_cnt++;
-
-					m_img_f1(px,py) = (m_img_f1(px,py)+avg)/2;
-
-					df = avg - m_img_f2(nx,ny);
-					df_max = std::max(std::abs(df), df_max);
-					df_sum += std::abs(df);
-					df_cnt++;
-
-					m_img_f2(nx,ny) = (m_img_f2(nx,ny)+avg)/2;
-					break;
-				case 21:
-					avg = (m_img_f2(px,py) + m_img_f1(nx,ny))/2;
-
-					df = avg - m_img_f2(px,py);
-					df_max = std::max(std::abs(df), df_max);
-					df_sum += std::abs(df);
-					df_cnt++;
-
-					m_img_f2(px,py) = (m_img_f2(px,py)+avg)/2;
-
-					df = avg - m_img_f1(nx,ny);
-					df_max = std::max(std::abs(df), df_max);
-					df_sum += std::abs(df);
-					df_cnt++;
-				
-					m_img_f1(nx,ny) = (m_img_f1(nx,ny)+avg)/2;
-					break;
-				case 22:
-					avg = (m_img_f2(px,py) + m_img_f2(nx,ny))/2;
-
-					df = avg - m_img_f2(px,py);
-					df_max = std::max(std::abs(df), df_max);
-					df_sum += std::abs(df);
-					df_cnt++;
-
-					m_img_f2(px,py) = (m_img_f2(px,py)+avg)/2;
-
-					df = avg - m_img_f2(nx,ny);
-					df_max = std::max(std::abs(df), df_max);
-					df_sum += std::abs(df);
-					df_cnt++;
-
-					m_img_f2(nx,ny) = (m_img_f2(nx,ny)+avg)/2;
-					break;
-			}
-		}
-	}
+			// the first digit of nn is the fraction of this pixel, the
+			// second one that of the neighbor meeting it
+			if ((nn != 11) && (nn != 12) && (nn != 21) && (nn != 22)) continue;
 
-	if (df_cnt > 0)
-		std::fprintf(stderr,"  %ld pairs, maximum error: %.3f, average: %.3f\n", df_cnt/2, df_max, df_sum/df_cnt);
-}
+			unsigned char &f = (nn < 20) ? m_img_f1(px,py) : m_img_f2(px,py);
+			unsigned char &fn = ((nn % 10) == 1) ? m_img_f1(nx,ny) : m_img_f2(nx,ny);
 
-bool Gray2Vec_Grid::Vectorize(const std::string file, const std::string layer, const bool Append)
-{
-	std::fprintf(stderr,"Generating subgrid...\n");
+			// the fractions do not change any more once they are equal
+			if (f != fn) Stats.cnt_tuned++;
 
-	CImg<unsigned char> img_h = CImg<unsigned char>(m_img.width(), m_img.height(), 1, 1);
+			// every pair is adjusted twice (originally once from either side),
+			// both are done when processing the first pixel of the pair
+			// so the result does not depend on the order of processing
+			for (int j = 0; j < 2; j++)
+			{
+				avg = (f + fn)/2;
 
-	if (m_debug)
-	{
-		m_img_s.save("debug-s.tif");
-		m_img_n.save("debug-n.tif");
-		m_img_f1.save("debug-f1.tif");
-		m_img_f2.save("debug-f2.tif");
-		m_img_f3.save("debug-f3.tif");
-	}
+				df = avg - f;
+				Stats.df_max = std::max(std::abs(df), Stats.df_max);
+				Stats.df_sum += std::abs(df);
+				Stats.df_cnt++;
 
-	cimg_forXY(m_img_s,px,py)
-	{
-		if (m_img_s(px,py) == 0)
-		{
-			img_h(px*2,py*2) = 0;
-			img_h(px*2+1,py*2) = 0;
-			img_h(px*2,py*2+1) = 0;
-			img_h(px*2+1,py*2+1) = 0;
-		}
-		else if (m_img_s(px,py) == 255)
-		{
-			img_h(px*2,py*2) = 255;
-			img_h(px*2+1,py*2) = 255;
-			img_h(px*2,py*2+1) = 255;
-			img_h(px*2+1,py*2+1) = 255;
-		}
-		else
-		{
-			switch (m_img_n(px,py))
-			{
-				case 1:
-					img_h(px*2,py*2) = 255;
-					img_h(px*2+1,py*2) = 0;
-					img_h(px*2,py*2+1) = 0;
-					img_h(px*2+1,py*2+1) = 0;
-					break;
-				case 2:
-					img_h(px*2,py*2) = 255;
-					img_h(px*2+1,py*2) = 255;
-					img_h(px*2,py*2+1) = 0;
-					img_h(px*2+1,py*2+1) = 0;
-					break;
-				case 3:
-					img_h(px*2,py*2) = 0;
-					img_h(px*2+1,py*2) = 255;
-					img_h(px*2,py*2+1) = 0;
-					img_h(px*2+1,py*2+1) = 0;
-					break;
-				case 4:
-					img_h(px*2,py*2) = 0;
-					img_h(px*2+1,py*2) = 255;
-					img_h(px*2,py*2+1) = 0;
-					img_h(px*2+1,py*2+1) = 255;
-					break;
-				case 5:
-					img_h(px*2,py*2) = 0;
-					img_h(px*2+1,py*2) = 0;
-					img_h(px*2,py*2+1) = 0;
-					img_h(px*2+1,py*2+1) = 255;
-					break;
-				case 6:
-					img_h(px*2,py*2) = 0;
-					img_h(px*2+1,py*2) = 0;
-					img_h(px*2,py*2+1) = 255;
-					img_h(px*2+1,py*2+1) = 255;
-					break;
-				case 7:
-					img_h(px*2,py*2) = 0;
-					img_h(px*2+1,py*2) = 0;
-					img_h(px*2,py*2+1) = 255;
-					img_h(px*2+1,py*2+1) = 0;
-					break;
-				case 8:
-					img_h(px*2,py*2) = 255;
-					img_h(px*2+1,py*2) = 0;
-					img_h(px*2,py*2+1) = 255;
-					img_h(px*2+1,py*2+1) = 0;
-					break;
-				case 11:
-					img_h(px*2,py*2) = 255;
-					img_h(px*2+1,py*2) = 255;
-					img_h(px*2,py*2+1) = 255;
-					img_h(px*2+1,py*2+1) = 0;
-					break;
-				case 13:
-					img_h(px*2,py*2) = 255;
-					img_h(px*2+1,py*2) = 255;
-					img_h(px*2,py*2+1) = 0;
-					img_h(px*2+1,py*2+1) = 255;
-					break;
-				case 15:
-					img_h(px*2,py*2) = 0;
-					img_h(px*2+1,py*2) = 255;
-					img_h(px*2,py*2+1) = 255;
-					img_h(px*2+1,py*2+1) = 255;
-					break;
-				case 17:
-					img_h(px*2,py*2) = 255;
-					img_h(px*2+1,py*2) = 0;
-					img_h(px*2,py*2+1) = 255;
-					img_h(px*2+1,py*2+1) = 255;
-					break;
+				f = (f+avg)/2;
+
+				df = avg - fn;
+				Stats.df_max = std::max(std::abs(df), Stats.df_max);
+				Stats.df_sum += std::abs(df);
+				Stats.df_cnt++;
+
+				fn = (fn+avg)/2;
 			}
 		}
-
 	}
+}
 
-	std::fprintf(stderr,"Preparing vector file...\n");
-
+GDALDatasetH Gray2Vec_Grid::OpenOutput(const std::string file, const bool Append)
+{
 	const char *pszDriverName = "SQLite";
 	const char *Options[] = { "SPATIALITE=TRUE", "INIT_WITH_EPSG=no", NULL };
 	GDALDriverH hDriver;
 	GDALDatasetH hDS;
-	OGRLayerH hLayer;
-	OGRFieldDefnH hFieldDefn;
-	double x, y;
-	bool CreateLayer = false;
 
 	GDALAllRegister();
 
@@ -2046,16 +3049,8 @@ bool Gray2Vec_Grid::Vectorize(const std::string file, const std::string layer, c
 		if (hDS == NULL)
 		{
 			fprintf(stderr, "Opening output file failed.\n");
-			return false;
+			return NULL;
 		}
-
-#if GDAL_VERSION_MAJOR >= 2
-		hLayer = GDALDatasetGetLayerByName(hDS, layer.c_str() );
-#else
-		hLayer = OGR_DS_GetLayerByName(hDS, layer.c_str() );
-#endif
-
-		if( hLayer == NULL ) CreateLayer = true;
 	}
 	else
 	{
@@ -2069,7 +3064,7 @@ bool Gray2Vec_Grid::Vectorize(const std::string file, const std::string layer, c
 		if (hDriver == NULL)
 		{
 			fprintf(stderr, "%s driver not available.\n", pszDriverName);
-			return false;
+			return NULL;
 		}
 
 #if GDAL_VERSION_MAJOR >= 2
@@ -2081,12 +3076,76 @@ bool Gray2Vec_Grid::Vectorize(const std::string file, const std::string layer, c
 		if (hDS == NULL)
 		{
 			fprintf(stderr, "Creation of output file failed.\n");
-			return false;
+			return NULL;
 		}
+	}
+
+	return hDS;
+}
+
+void Gray2Vec_Grid::CloseOutput(GDALDatasetH hDS)
+{
+#if GDAL_VERSION_MAJOR >= 2
+	GDALClose(hDS);
+#else
+	OGR_DS_Destroy(hDS);
+#endif
+}
+
+bool Gray2Vec_Grid::Vectorize(const std::string file, const std::string layer, const bool Append)
+{
+	GDALDatasetH hDS = OpenOutput(file, Append);
+
+	if (hDS == NULL) return false;
+
+	bool Res = Vectorize(hDS, layer);
 
-		CreateLayer = true;
+	CloseOutput(hDS);
+
+	return Res;
+}
+
+bool Gray2Vec_Grid::Vectorize(GDALDatasetH hDS, const std::string layer)
+{
+	Load();
+
+	std::fprintf(stderr,"Generating subgrid...\n");
+
+	if (m_window > 0)
+	{
+		// in streaming mode the subgrid is generated line by line
+		// from the spool file while vectorizing
+		m_spool_n.assign((m_width+1)/2, m_window, 1, 1);
+		m_spool_f1.assign(m_width, m_window, 1, 1);
+		m_spool_f2.assign(m_width, m_window, 1, 1);
+		m_spool_f3.assign(m_width, m_window, 1, 1);
+		m_spool_rows.assign(m_window, -1);
+	}
+	else if (m_debug)
+	{
+		Deinterleave();
+		m_img_s.image().save("debug-s.tif");
+		m_img_n.image().save("debug-n.tif");
+		m_img_f1.image().save("debug-f1.tif");
+		m_img_f2.image().save("debug-f2.tif");
+		m_img_f3.image().save("debug-f3.tif");
 	}
 
+	std::fprintf(stderr,"Preparing vector file...\n");
+
+	OGRLayerH hLayer;
+	OGRFieldDefnH hFieldDefn;
+	bool CreateLayer = false;
+
+	// layers already present (when appending) are added to
+#if GDAL_VERSION_MAJOR >= 2
+	hLayer = GDALDatasetGetLayerByName(hDS, layer.c_str() );
+#else
+	hLayer = OGR_DS_GetLayerByName(hDS, layer.c_str() );
+#endif
+
+	if( hLayer == NULL ) CreateLayer = true;
+
 	if (CreateLayer)
 	{
 #if GDAL_VERSION_MAJOR >= 2
@@ -2101,39 +3160,63 @@ bool Gray2Vec_Grid::Vectorize(const std::string file, const std::string layer, c
 			return false;
 		}
 
-		if (m_x >= 0)
+		if (m_x >= 0)
+		{
+			hFieldDefn = OGR_Fld_Create( "x", OFTInteger );
+			OGR_Fld_SetWidth( hFieldDefn, 12);
+			if( OGR_L_CreateField( hLayer, hFieldDefn, TRUE ) != OGRERR_NONE )
+			{
+				fprintf(stderr, "Creating attribute field x failed.\n" );
+				return false;
+			}
+
+			OGR_Fld_Destroy(hFieldDefn);
+		}
+
+		if (m_y >= 0)
+		{
+			hFieldDefn = OGR_Fld_Create( "y", OFTInteger );
+			OGR_Fld_SetWidth( hFieldDefn, 12);
+			if( OGR_L_CreateField( hLayer, hFieldDefn, TRUE ) != OGRERR_NONE )
+			{
+				fprintf(stderr, "Creating attribute field y failed.\n" );
+				return false;
+			}
+
+			OGR_Fld_Destroy(hFieldDefn);
+		}
+
+		if (m_z >= 0)
 		{
-			hFieldDefn = OGR_Fld_Create( "x", OFTInteger );
+			hFieldDefn = OGR_Fld_Create( "z", OFTInteger );
 			OGR_Fld_SetWidth( hFieldDefn, 12);
 			if( OGR_L_CreateField( hLayer, hFieldDefn, TRUE ) != OGRERR_NONE )
 			{
-				fprintf(stderr, "Creating attribute field x failed.\n" );
+				fprintf(stderr, "Creating attribute field z failed.\n" );
 				return false;
 			}
 
 			OGR_Fld_Destroy(hFieldDefn);
 		}
 
-		if (m_y >= 0)
+		if (m_shards > 1)
 		{
-			hFieldDefn = OGR_Fld_Create( "y", OFTInteger );
+			// polygons cut at the shard boundaries are marked for gray2vec-merge
+			hFieldDefn = OGR_Fld_Create( "shard", OFTInteger );
 			OGR_Fld_SetWidth( hFieldDefn, 12);
 			if( OGR_L_CreateField( hLayer, hFieldDefn, TRUE ) != OGRERR_NONE )
 			{
-				fprintf(stderr, "Creating attribute field y failed.\n" );
+				fprintf(stderr, "Creating attribute field shard failed.\n" );
 				return false;
 			}
 
 			OGR_Fld_Destroy(hFieldDefn);
-		}
 
-		if (m_z >= 0)
-		{
-			hFieldDefn = OGR_Fld_Create( "z", OFTInteger );
+			hFieldDefn = OGR_Fld_Create( "seam", OFTInteger );
 			OGR_Fld_SetWidth( hFieldDefn, 12);
 			if( OGR_L_CreateField( hLayer, hFieldDefn, TRUE ) != OGRERR_NONE )
 			{
-				fprintf(stderr, "Creating attribute field z failed.\n" );
+				fprintf(stderr, "Creating attribute field seam failed.\n" );
 				return false;
 			}
 
@@ -2143,14 +3226,125 @@ bool Gray2Vec_Grid::Vectorize(const std::string file, const std::string layer, c
 
 	std::fprintf(stderr,"Vectorizing grid...\n");
 
-	Polygonize(img_h, hLayer);
+	bool Res = Polygonize(hLayer);
 
-#if GDAL_VERSION_MAJOR >= 2
-	GDALClose(hDS);
-#else
-	OGR_DS_Destroy(hDS);
-#endif
+	return Res;
+}
+
+void Gray2Vec_Grid::SpoolRow(const int py)
+{
+	// the codes are stored packed like in memory
+	const int nn = (m_width+1)/2;
+	const vsi_l_offset nOffset = vsi_l_offset(py)*(m_width*(sizeof(short)+2)+nn);
+
+	VSIFSeekL(m_spool, nOffset, SEEK_SET);
+
+	if ((VSIFWriteL(m_img_f3.row(py), sizeof(short), m_width, m_spool) != size_t(m_width)) ||
+			(VSIFWriteL(m_img_n.row(py), 1, nn, m_spool) != size_t(nn)) ||
+			(VSIFWriteL(m_img_f1.row(py), 1, m_width, m_spool) != size_t(m_width)) ||
+			(VSIFWriteL(m_img_f2.row(py), 1, m_width, m_spool) != size_t(m_width)))
+	{
+		std::fprintf(stderr,"  error writing temporary file %s.\n\n", m_spool_file.c_str());
+		std::exit(1);
+	}
+}
+
+Gray2Vec_Cell Gray2Vec_Grid::GetCell(const int px, const int py)
+{
+	Gray2Vec_Cell c;
+
+	// outside the grid
+	if ((px < 0) || (py < 0) || (px >= m_width) || (py >= m_height))
+	{
+		c.n = 0;
+		c.f1 = 0;
+		c.f2 = 0;
+		c.f3 = -1;
+		return c;
+	}
+
+	if (m_spool == NULL)
+	{
+		c.n = m_img_n(px,py);
+		c.f1 = m_img_f1(px,py);
+		c.f2 = m_img_f2(px,py);
+		c.f3 = m_img_f3(px,py);
+		return c;
+	}
+
+	// lines are cached in memory with a fixed slot for every line
+	const int slot = py % m_spool_rows.size();
+
+	if (m_spool_rows[slot] != py)
+	{
+		const int nn = (m_width+1)/2;
+		const vsi_l_offset nOffset = vsi_l_offset(py)*(m_width*(sizeof(short)+2)+nn);
+
+		VSIFSeekL(m_spool, nOffset, SEEK_SET);
+
+		if ((VSIFReadL(m_spool_f3.data(0,slot), sizeof(short), m_width, m_spool) != size_t(m_width)) ||
+				(VSIFReadL(m_spool_n.data(0,slot), 1, nn, m_spool) != size_t(nn)) ||
+				(VSIFReadL(m_spool_f1.data(0,slot), 1, m_width, m_spool) != size_t(m_width)) ||
+				(VSIFReadL(m_spool_f2.data(0,slot), 1, m_width, m_spool) != size_t(m_width)))
+		{
+			std::fprintf(stderr,"  error reading temporary file %s.\n\n", m_spool_file.c_str());
+			std::exit(1);
+		}
+
+		m_spool_rows[slot] = py;
+	}
+
+	c.n = Gray2Vec_StateCode[(m_spool_n(px/2,slot) >> ((px & 1)*4)) & 15];
+	c.f1 = m_spool_f1(px,slot);
+	c.f2 = m_spool_f2(px,slot);
+	c.f3 = m_spool_f3(px,slot);
+
+	return c;
+}
+
+int Gray2Vec_Grid::SubgridRows()
+{
+	if (m_shards > 1)
+		return 2*(m_out1-m_out0);
+
+	return m_poBand->GetYSize();
+}
+
+void Gray2Vec_Grid::SubgridRow(const int iY, int *panLineVal)
+{
+	const int nXSize = m_poBand->GetXSize();
+	const int py = iY/2 + m_out0;
+	// bits of the 2x2 pattern for the line
+	const int shift = 2*(iY % 2);
+
+	for (int px = 0; px < m_width; px++)
+	{
+		// uniform blocks are either completely inside or outside the polygons
+		if ((px % BlockSize == 0) && (py < m_height) && block_uniform(px/BlockSize, py/BlockSize))
+		{
+			const int px1 = std::min(m_width, px+BlockSize);
+			const int v = (m_block_min[size_t(py/BlockSize)*m_blocks_x + px/BlockSize] == 255) ? 255 : GP_NODATA_MARKER;
+
+			for (int iX = px*2; iX < px1*2; iX++)
+				panLineVal[iX] = v;
+
+			px = px1-1;
+			continue;
+		}
+
+		// subpixels of the 2x2 pattern: 1 2
+		//                                4 8
+		const int st = ((m_spool == NULL) && (py < m_height)) ? m_img_n.state(px,py) : Gray2Vec_CodeState.state[GetCell(px,py).n];
+
+		const int m = StateTable.subgrid[st] >> shift;
 
+		panLineVal[px*2] = (m & 1) ? 255 : GP_NODATA_MARKER;
+		panLineVal[px*2+1] = (m & 2) ? 255 : GP_NODATA_MARKER;
+	}
+
+	// columns not covered by the reduced grid
+	for (int iX = m_width*2; iX < nXSize; iX++)
+		panLineVal[iX] = GP_NODATA_MARKER;
 }
 
 /*
@@ -2194,6 +3388,10 @@ bool Gray2Vec_Grid::EmitPolygonToLayer(OGRLayerH hOutLayer, RPolygon *poRPoly)
 	/* -------------------------------------------------------------------- */
 	size_t iString;
 
+	// shard boundaries touched by the polygon: 1: top, 2: bottom
+	int nSeam = 0;
+	const int nYSize = SubgridRows();
+
 	hPolygon = OGR_G_CreateGeometry( wkbPolygon );
 
 	for( iString = 0; iString < poRPoly->aanXY.size(); iString++ )
@@ -2213,11 +3411,22 @@ bool Gray2Vec_Grid::EmitPolygonToLayer(OGRLayerH hOutLayer, RPolygon *poRPoly)
 			nPixelX = anString[iVert*2];
 			nPixelY = anString[iVert*2+1];
 
+			if (m_shards > 1)
+			{
+				if ((nPixelY == 0) && (m_shard > 0)) nSeam |= 1;
+				if ((nPixelY == nYSize) && (m_shard < m_shards-1)) nSeam |= 2;
+			}
+
+			// position in the whole image
+			nPixelY += 2*(m_row0 + m_out0);
+
 			double fx = nPixelX;
 			double fy = nPixelY;
 
 			int px = nPixelX/2;
-			int py = nPixelY/2;
+			int py = nPixelY/2 - m_row0;
+
+			Gray2Vec_Cell c = GetCell(px,py);
 
 			double fA = -1.0;
 			double fB = -1.0;
@@ -2230,35 +3439,11 @@ bool Gray2Vec_Grid::EmitPolygonToLayer(OGRLayerH hOutLayer, RPolygon *poRPoly)
 					// vertical middle
 
 					// right side
-					switch (m_img_n(px,py))
-					{
-						case 1:
-						case 2:
-						case 13:
-							fA = m_img_f2(px,py);
-							break;
-						case 15:
-						case 6:
-						case 7:
-							fA = 255-m_img_f1(px,py);
-							break;
-					}
+					fA = cell_edge(c, NbW);
 
 					// left side
 					if (px > 0)
-					switch (m_img_n(px-1,py))
-					{
-						case 11:
-						case 2:
-						case 3:
-							fB = m_img_f1(px-1,py);
-							break;
-						case 5:
-						case 6:
-						case 17:
-							fB = 255-m_img_f2(px-1,py);
-							break;
-					}
+						fB = cell_edge(GetCell(px-1,py), NbE);
 
 					// average both sides
 					if (fA >= 0.0)
@@ -2283,35 +3468,11 @@ bool Gray2Vec_Grid::EmitPolygonToLayer(OGRLayerH hOutLayer, RPolygon *poRPoly)
 					// horizontal middle
 
 					// bottom side
-					switch (m_img_n(px,py))
-					{
-						case 17:
-						case 8:
-						case 1:
-							fA = m_img_f1(px,py);
-							break;
-						case 3:
-						case 4:
-						case 15:
-							fA = 255-m_img_f2(px,py);
-							break;
-					}
+					fA = cell_edge(c, NbN);
 
 					// top side
 					if (py > 0)
-					switch (m_img_n(px,py-1))
-					{
-						case 7:
-						case 8:
-						case 11:
-							fB = m_img_f2(px,py-1);
-							break;
-						case 13:
-						case 4:
-						case 5:
-							fB = 255-m_img_f1(px,py-1);
-							break;
-					}
+						fB = cell_edge(GetCell(px,py-1), NbS);
 
 					// average both sides
 					if (fA >= 0.0)
@@ -2333,33 +3494,33 @@ bool Gray2Vec_Grid::EmitPolygonToLayer(OGRLayerH hOutLayer, RPolygon *poRPoly)
 					double df;
 
 					// middle in both directions: unnecessary point - unless necessary to limit error
-					switch (m_img_n(px,py))
+					switch (c.n)
 					{
 						case 1:
 						case 3:
 						case 5:
 						case 7:
-							if (m_img_f3(px,py) >= 0)
+							if (c.f3 >= 0)
 							{
-								if (m_img_n(px,py) == 1)
+								if (c.n == 1)
 								{
-									fx += 2.0*double(m_img_f1(px,py)*m_img_f3(px,py))/(255*255)-1;
-									fy += 2.0*double(m_img_f2(px,py)*m_img_f3(px,py))/(255*255)-1;
+									fx += 2.0*double(c.f1*c.f3)/(255*255)-1;
+									fy += 2.0*double(c.f2*c.f3)/(255*255)-1;
 								}
-								else if (m_img_n(px,py) == 3)
+								else if (c.n == 3)
 								{
-									fx += -2.0*double(m_img_f1(px,py)*m_img_f3(px,py))/(255*255)+1;
-									fy += 2.0*double(m_img_f2(px,py)*m_img_f3(px,py))/(255*255)-1;
+									fx += -2.0*double(c.f1*c.f3)/(255*255)+1;
+									fy += 2.0*double(c.f2*c.f3)/(255*255)-1;
 								}
-								else if (m_img_n(px,py) == 5)
+								else if (c.n == 5)
 								{
-									fx += -2.0*double(m_img_f1(px,py)*m_img_f3(px,py))/(255*255)+1;
-									fy += -2.0*double(m_img_f2(px,py)*m_img_f3(px,py))/(255*255)+1;
+									fx += -2.0*double(c.f1*c.f3)/(255*255)+1;
+									fy += -2.0*double(c.f2*c.f3)/(255*255)+1;
 								}
-								else if (m_img_n(px,py) == 7)
+								else if (c.n == 7)
 								{
-									fx += 2.0*double(m_img_f1(px,py)*m_img_f3(px,py))/(255*255)-1;
-									fy += -2.0*double(m_img_f2(px,py)*m_img_f3(px,py))/(255*255)+1;
+									fx += 2.0*double(c.f1*c.f3)/(255*255)-1;
+									fy += -2.0*double(c.f2*c.f3)/(255*255)+1;
 								}
 								//std::fprintf(stderr," Precalculated error compenation corner at (%d/%d): %d, %d\n", px, py, m_img_s(px,py), m_img_f3(px,py));
 							}
@@ -2371,23 +3532,23 @@ bool Gray2Vec_Grid::EmitPolygonToLayer(OGRLayerH hOutLayer, RPolygon *poRPoly)
 						case 4:
 						case 6:
 						case 8:
-							if (m_img_f3(px,py) >= 0)
+							if (c.f3 >= 0)
 							{
-								if (m_img_n(px,py) == 2)
+								if (c.n == 2)
 								{
-									fy += 2.0*double(m_img_f3(px,py))/255-1;
+									fy += 2.0*double(c.f3)/255-1;
 								}
-								else if (m_img_n(px,py) == 4)
+								else if (c.n == 4)
 								{
-									fx += -2.0*double(m_img_f3(px,py))/255+1;
+									fx += -2.0*double(c.f3)/255+1;
 								}
-								else if (m_img_n(px,py) == 6)
+								else if (c.n == 6)
 								{
-									fy += -2.0*double(m_img_f3(px,py))/255+1;
+									fy += -2.0*double(c.f3)/255+1;
 								}
-								else if (m_img_n(px,py) == 8)
+								else if (c.n == 8)
 								{
-									fx += 2.0*double(m_img_f3(px,py))/255-1;
+									fx += 2.0*double(c.f3)/255-1;
 								}
 							}
 							else
@@ -2398,27 +3559,27 @@ bool Gray2Vec_Grid::EmitPolygonToLayer(OGRLayerH hOutLayer, RPolygon *poRPoly)
 						case 13:
 						case 15:
 						case 17:
-							if (m_img_f3(px,py) >= 0)
+							if (c.f3 >= 0)
 							{
-								if (m_img_n(px,py) == 1)
+								if (c.n == 1)
 								{
-									fx += 2.0*double(m_img_f1(px,py)*m_img_f3(px,py))/(255*255)-1;
-									fy += 2.0*double(m_img_f2(px,py)*m_img_f3(px,py))/(255*255)-1;
+									fx += 2.0*double(c.f1*c.f3)/(255*255)-1;
+									fy += 2.0*double(c.f2*c.f3)/(255*255)-1;
 								}
-								else if (m_img_n(px,py) == 3)
+								else if (c.n == 3)
 								{
-									fx += -2.0*double(m_img_f1(px,py)*m_img_f3(px,py))/(255*255)+1;
-									fy += 2.0*double(m_img_f2(px,py)*m_img_f3(px,py))/(255*255)-1;
+									fx += -2.0*double(c.f1*c.f3)/(255*255)+1;
+									fy += 2.0*double(c.f2*c.f3)/(255*255)-1;
 								}
-								else if (m_img_n(px,py) == 5)
+								else if (c.n == 5)
 								{
-									fx += -2.0*double(m_img_f1(px,py)*m_img_f3(px,py))/(255*255)+1;
-									fy += -2.0*double(m_img_f2(px,py)*m_img_f3(px,py))/(255*255)+1;
+									fx += -2.0*double(c.f1*c.f3)/(255*255)+1;
+									fy += -2.0*double(c.f2*c.f3)/(255*255)+1;
 								}
-								else if (m_img_n(px,py) == 7)
+								else if (c.n == 7)
 								{
-									fx += 2.0*double(m_img_f1(px,py)*m_img_f3(px,py))/(255*255)-1;
-									fy += -2.0*double(m_img_f2(px,py)*m_img_f3(px,py))/(255*255)+1;
+									fx += 2.0*double(c.f1*c.f3)/(255*255)-1;
+									fy += -2.0*double(c.f2*c.f3)/(255*255)+1;
 								}
 								//std::fprintf(stderr," Precalculated error compenation corner at (%d/%d): %d, %d\n", px, py, m_img_s(px,py), m_img_f3(px,py));
 							}
@@ -2454,6 +3615,11 @@ bool Gray2Vec_Grid::EmitPolygonToLayer(OGRLayerH hOutLayer, RPolygon *poRPoly)
 		OGR_F_SetFieldInteger( hFeat, OGR_F_GetFieldIndex(hFeat, "y"), m_y );
 	if (m_z >= 0)
 		OGR_F_SetFieldInteger( hFeat, OGR_F_GetFieldIndex(hFeat, "z"), m_z );
+	if (m_shards > 1)
+	{
+		OGR_F_SetFieldInteger( hFeat, OGR_F_GetFieldIndex(hFeat, "shard"), m_shard );
+		OGR_F_SetFieldInteger( hFeat, OGR_F_GetFieldIndex(hFeat, "seam"), nSeam );
+	}
 
 	OGR_G_CloseRings( hPolygon );
 
@@ -2497,10 +3663,14 @@ bool Gray2Vec_Grid::EmitPolygonToLayer(OGRLayerH hOutLayer, RPolygon *poRPoly)
  * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
  * DEALINGS IN THE SOFTWARE.
  ****************************************************************************/
-bool Gray2Vec_Grid::Polygonize(CImg<unsigned char> &img_h, OGRLayerH hOutLayer)
+bool Gray2Vec_Grid::Polygonize(OGRLayerH hOutLayer)
 {
 	int nConnectedness = 4;
 
+	// the spool file cache in streaming mode is not thread safe
+	if ((m_threads > 1) && (m_spool == NULL))
+		return PolygonizeThreaded(hOutLayer);
+
 	if( !OGR_L_TestCapability( hOutLayer, OLCSequentialWrite ) )
 	{
 		fprintf(stderr, "Output feature layer does not appear to support creation\nof features in GDALPolygonize().\n");
@@ -2511,8 +3681,8 @@ bool Gray2Vec_Grid::Polygonize(CImg<unsigned char> &img_h, OGRLayerH hOutLayer)
 	/*      Allocate working buffers.                                       */
 	/* -------------------------------------------------------------------- */
 	bool Res = true;
-	int nXSize = img_h.width();
-	int nYSize = img_h.height();
+	int nXSize = m_poBand->GetXSize();
+	int nYSize = SubgridRows();
 
 #if GDAL_VERSION_MAJOR >= 2
 	int *panLastLineVal = (int *) VSI_MALLOC2_VERBOSE(sizeof(int),nXSize + 2);
@@ -2549,13 +3719,7 @@ bool Gray2Vec_Grid::Polygonize(CImg<unsigned char> &img_h, OGRLayerH hOutLayer)
 	for( iY = 0; Res && iY < nYSize; iY++ )
 	{
 
-		for (int iX = 0; iX < nXSize; iX++)
-		{
-			if (img_h(iX,iY) > 0)
-				panThisLineVal[iX] = img_h(iX,iY);
-			else
-				panThisLineVal[iX] = GP_NODATA_MARKER;
-		}
+		SubgridRow(iY, panThisLineVal);
 
 		if( iY == 0 )
 			oFirstEnum.ProcessLine(
@@ -2616,11 +3780,7 @@ bool Gray2Vec_Grid::Polygonize(CImg<unsigned char> &img_h, OGRLayerH hOutLayer)
 		/* -------------------------------------------------------------------- */
 		if( iY < nYSize )
 		{
-			for (int iX = 0; iX < nXSize; iX++)
-				if (img_h(iX,iY) > 0)
-					panThisLineVal[iX] = img_h(iX,iY);
-				else
-					panThisLineVal[iX] = GP_NODATA_MARKER;
+			SubgridRow(iY, panThisLineVal);
 		}
 
 		/* -------------------------------------------------------------------- */
@@ -2709,3 +3869,306 @@ bool Gray2Vec_Grid::Polygonize(CImg<unsigned char> &img_h, OGRLayerH hOutLayer)
 	return Res;
 }
 
+/// polygon edges of a band of lines from the second pass of PolygonizeThreaded()
+struct Gray2Vec_EdgeBand
+{
+	/// lines of the band
+	int y0;
+	int y1;
+
+	/// state of the polygon enumerator at the start of the band
+	std::vector<GInt32> anPolyIdMap;
+	std::vector<int> anPolyValue;
+	std::vector<int> anLastLineVal;
+	std::vector<GInt32> anLastLineId;
+
+	/// polygon edges in the order they are found (id, x1, y1, x2, y2)
+	std::vector<int> anEdges;
+	/// end of the edges of every line in anEdges
+	std::vector<size_t> anLineEnd;
+};
+
+/*
+ * This method is derived from Polygonize() above and therefore from
+ * polygonize.cpp from the gdal source package - see copyright notice
+ * above.
+ *
+ * The first pass enumerating the polygons is done sequentially, the
+ * state of the enumerator is recorded at the start of every band of
+ * lines.  The second pass then is run for all bands in parallel starting
+ * from these states which yields the same polygon ids as a sequential
+ * run.  The polygon edges are recorded and added to the polygons in the
+ * original order so the polygons are written exactly as by Polygonize().
+ */
+bool Gray2Vec_Grid::PolygonizeThreaded(OGRLayerH hOutLayer)
+{
+	int nConnectedness = 4;
+
+	if( !OGR_L_TestCapability( hOutLayer, OLCSequentialWrite ) )
+	{
+		fprintf(stderr, "Output feature layer does not appear to support creation\nof features in GDALPolygonize().\n");
+		return false;
+	}
+
+	bool Res = true;
+	int nXSize = m_poBand->GetXSize();
+	int nYSize = SubgridRows();
+
+	// bands of lines of the second pass (which has nYSize+1 lines)
+	const int nBands = std::min(m_threads*4, nYSize+1);
+
+	std::vector<Gray2Vec_EdgeBand> aoBands(nBands);
+
+	for (int b = 0; b < nBands; b++)
+	{
+		aoBands[b].y0 = (size_t(nYSize+1)*b)/nBands;
+		aoBands[b].y1 = (size_t(nYSize+1)*(b+1))/nBands;
+	}
+
+	std::vector<int> anLastLineVal(nXSize + 2);
+	std::vector<int> anThisLineVal(nXSize + 2);
+	std::vector<GInt32> anLastLineId(nXSize + 2);
+	std::vector<GInt32> anThisLineId(nXSize + 2);
+
+	// number of polygon ids after every line
+	std::vector<int> anNextPolygonId(nYSize+1);
+
+	/* -------------------------------------------------------------------- */
+	/*      First pass - recording the enumerator state at the start of     */
+	/*      every band.                                                     */
+	/* -------------------------------------------------------------------- */
+	GDALRasterPolygonEnumeratorT<int, IntEqualityTest> oFirstEnum(nConnectedness);
+
+	int b = 0;
+	for( int iY = 0; iY <= nYSize; iY++ )
+	{
+		while ((b < nBands) && (aoBands[b].y0 == iY))
+		{
+			Gray2Vec_EdgeBand &oBand = aoBands[b];
+
+			oBand.anPolyIdMap.assign(oFirstEnum.panPolyIdMap, oFirstEnum.panPolyIdMap + oFirstEnum.nNextPolygonId);
+			oBand.anPolyValue.assign(oFirstEnum.panPolyValue, oFirstEnum.panPolyValue + oFirstEnum.nNextPolygonId);
+
+			// the second pass uses line ids with an offset of one
+			oBand.anLastLineVal = anLastLineVal;
+			oBand.anLastLineId.assign(nXSize + 2, -1);
+			if (iY > 0)
+				std::copy(anLastLineId.begin(), anLastLineId.begin() + nXSize, oBand.anLastLineId.begin()+1);
+
+			b++;
+		}
+
+		if (iY == nYSize) break;
+
+		SubgridRow(iY, &anThisLineVal[0]);
+
+		if( iY == 0 )
+			oFirstEnum.ProcessLine(
+														 NULL, &anThisLineVal[0], NULL, &anThisLineId[0], nXSize );
+		else
+			oFirstEnum.ProcessLine(
+														 &anLastLineVal[0], &anThisLineVal[0],
+														 &anLastLineId[0],  &anThisLineId[0],
+														 nXSize );
+
+		anNextPolygonId[iY] = oFirstEnum.nNextPolygonId;
+
+		anLastLineVal.swap(anThisLineVal);
+		anLastLineId.swap(anThisLineId);
+	}
+
+	// last line of the second pass does not add polygons
+	anNextPolygonId[nYSize] = (nYSize > 0) ? anNextPolygonId[nYSize-1] : 0;
+
+	/* -------------------------------------------------------------------- */
+	/*      Make a pass through the maps, ensuring every polygon id         */
+	/*      points to the final id it should use, not an intermediate       */
+	/*      value.                                                          */
+	/* -------------------------------------------------------------------- */
+	oFirstEnum.CompleteMerges();
+
+	RPolygon **papoPoly = (RPolygon **)
+		CPLCalloc(sizeof(RPolygon*),oFirstEnum.nNextPolygonId);
+
+	/* ==================================================================== */
+	/*      Second pass in parallel for groups of m_threads bands, the      */
+	/*      edges of the previous group are added to the polygons while     */
+	/*      the next group is processed.                                    */
+	/* ==================================================================== */
+	for( int b0 = 0; b0 < nBands+m_threads; b0 += m_threads )
+	{
+		std::vector<std::thread> threads;
+
+		for (b = b0; b < std::min(b0+m_threads, nBands); b++)
+			threads.push_back(std::thread(&Gray2Vec_Grid::PolygonizeBand, this, &aoBands[b], oFirstEnum.panPolyIdMap));
+
+		for (b = std::max(b0-m_threads, 0); Res && (b < std::min(b0, nBands)); b++)
+		{
+			Gray2Vec_EdgeBand &oBand = aoBands[b];
+			size_t iEdge = 0;
+
+			for( int iY = oBand.y0; Res && iY < oBand.y1; iY++ )
+			{
+				for (; iEdge < oBand.anLineEnd[iY-oBand.y0]; iEdge += 5)
+				{
+					const int nId = oBand.anEdges[iEdge];
+
+					if( papoPoly[nId] == NULL )
+						papoPoly[nId] = new RPolygon( oFirstEnum.panPolyValue[nId] );
+
+					papoPoly[nId]->AddSegment( oBand.anEdges[iEdge+1], oBand.anEdges[iEdge+2], oBand.anEdges[iEdge+3], oBand.anEdges[iEdge+4] );
+				}
+
+				/* -------------------------------------------------------------------- */
+				/*      Periodically we scan out polygons and write out those that      */
+				/*      haven't been added to on the last line as we can be sure        */
+				/*      they are complete.                                              */
+				/* -------------------------------------------------------------------- */
+				if( iY % 8 == 7 )
+				{
+					for( int iX = 0; Res && iX < anNextPolygonId[iY]; iX++ )
+					{
+						if( papoPoly[iX] && papoPoly[iX]->nLastLineUpdated < iY-1 )
+						{
+							Res = EmitPolygonToLayer(hOutLayer, papoPoly[iX]);
+							delete papoPoly[iX];
+							papoPoly[iX] = NULL;
+						}
+					}
+				}
+			}
+
+			std::vector<int>().swap(oBand.anEdges);
+		}
+
+		for (size_t t = 0; t < threads.size(); t++)
+			threads[t].join();
+	}
+
+	/* -------------------------------------------------------------------- */
+	/*      Make a cleanup pass for all unflushed polygons.                 */
+	/* -------------------------------------------------------------------- */
+	for( int iX = 0; iX < oFirstEnum.nNextPolygonId; iX++ )
+	{
+		if( Res && papoPoly[iX] )
+			Res = EmitPolygonToLayer(hOutLayer, papoPoly[iX]);
+		delete papoPoly[iX];
+		papoPoly[iX] = NULL;
+	}
+
+	CPLFree( papoPoly );
+
+	return Res;
+}
+
+void Gray2Vec_Grid::PolygonizeBand(Gray2Vec_EdgeBand *Band, GInt32 *panPolyIdMap)
+{
+	int nXSize = m_poBand->GetXSize();
+	int nYSize = SubgridRows();
+
+	/* -------------------------------------------------------------------- */
+	/*      Set up the enumerator as it was at the start of the band in     */
+	/*      the first pass.                                                 */
+	/* -------------------------------------------------------------------- */
+	GDALRasterPolygonEnumeratorT<int, IntEqualityTest> oEnum(4);
+
+	const int nPolys = Band->anPolyIdMap.size();
+
+	oEnum.nPolyAlloc = nPolys + 20;
+	oEnum.panPolyIdMap = (GInt32 *) CPLMalloc(sizeof(GInt32)*oEnum.nPolyAlloc);
+	oEnum.panPolyValue = (int *) CPLMalloc(sizeof(int)*oEnum.nPolyAlloc);
+	if (nPolys > 0)
+	{
+		std::memcpy(oEnum.panPolyIdMap, &Band->anPolyIdMap[0], sizeof(GInt32)*nPolys);
+		std::memcpy(oEnum.panPolyValue, &Band->anPolyValue[0], sizeof(int)*nPolys);
+	}
+	oEnum.nNextPolygonId = nPolys;
+
+	std::vector<GInt32>().swap(Band->anPolyIdMap);
+	std::vector<int>().swap(Band->anPolyValue);
+
+	std::vector<int> anLastLineVal;
+	std::vector<GInt32> anLastLineId;
+	anLastLineVal.swap(Band->anLastLineVal);
+	anLastLineId.swap(Band->anLastLineId);
+
+	std::vector<int> anThisLineVal(nXSize + 2);
+	std::vector<GInt32> anThisLineId(nXSize + 2);
+
+	anThisLineId[0] = -1;
+	anThisLineId[nXSize+1] = -1;
+
+	Band->anLineEnd.resize(Band->y1 - Band->y0);
+
+	for( int iY = Band->y0; iY < Band->y1; iY++ )
+	{
+		if( iY < nYSize )
+			SubgridRow(iY, &anThisLineVal[0]);
+
+		if( iY == nYSize )
+		{
+			for( int iX = 0; iX < nXSize+2; iX++ )
+				anThisLineId[iX] = -1;
+		}
+		else if( iY == 0 )
+			oEnum.ProcessLine(
+												NULL, &anThisLineVal[0], NULL, &anThisLineId[0]+1, nXSize );
+		else
+			oEnum.ProcessLine(
+												&anLastLineVal[0], &anThisLineVal[0],
+												&anLastLineId[0]+1,  &anThisLineId[0]+1,
+												nXSize );
+
+		/* -------------------------------------------------------------------- */
+		/*      Record polygon edges for the pixel boundaries within and        */
+		/*      above this line in the same order as AddEdges() adds them.      */
+		/* -------------------------------------------------------------------- */
+		for( int iX = 0; iX < nXSize+1; iX++ )
+		{
+			int nThisId = anThisLineId[iX];
+			int nRightId = anThisLineId[iX+1];
+			int nPreviousId = anLastLineId[iX];
+			int iXReal = iX - 1;
+
+			if( nThisId != -1 )
+				nThisId = panPolyIdMap[nThisId];
+			if( nRightId != -1 )
+				nRightId = panPolyIdMap[nRightId];
+			if( nPreviousId != -1 )
+				nPreviousId = panPolyIdMap[nPreviousId];
+
+			if( nThisId != nPreviousId )
+			{
+				if( nThisId != -1 )
+				{
+					const int anEdge[5] = { nThisId, iXReal, iY, iXReal+1, iY };
+					Band->anEdges.insert(Band->anEdges.end(), anEdge, anEdge+5);
+				}
+				if( nPreviousId != -1 )
+				{
+					const int anEdge[5] = { nPreviousId, iXReal, iY, iXReal+1, iY };
+					Band->anEdges.insert(Band->anEdges.end(), anEdge, anEdge+5);
+				}
+			}
+
+			if( nThisId != nRightId )
+			{
+				if( nThisId != -1 )
+				{
+					const int anEdge[5] = { nThisId, iXReal+1, iY, iXReal+1, iY+1 };
+					Band->anEdges.insert(Band->anEdges.end(), anEdge, anEdge+5);
+				}
+				if( nRightId != -1 )
+				{
+					const int anEdge[5] = { nRightId, iXReal+1, iY, iXReal+1, iY+1 };
+					Band->anEdges.insert(Band->anEdges.end(), anEdge, anEdge+5);
+				}
+			}
+		}
+
+		Band->anLineEnd[iY - Band->y0] = Band->anEdges.size();
+
+		anLastLineVal.swap(anThisLineVal);
+		anLastLineId.swap(anThisLineId);
+	}
+}
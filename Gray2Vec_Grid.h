@@ -32,6 +32,8 @@
 
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <cmath>
 
 #include <gdal_priv.h>
 #include <ogrsf_frmts.h>
@@ -42,16 +44,170 @@
 
 #include "CImg.h"
 
+#include "Gray2Vec_Plane.h"
+#include "Gray2Vec_Reader.h"
+#include "Gray2Vec_Pool.h"
+
 using namespace cimg_library;
 
 const static int x4[4] = { -1,0,1,0 };
 const static int y4[4] = { 0,-1,0,1 };
 
+/// processing steps, each of them is a single pass over the grid
+enum Gray2Vec_StepType
+{
+	G2V_ANALYZE,
+	G2V_OPTIMIZE_SIDES,
+	G2V_SMOOTH_EDGES,
+	G2V_RESOLVE_CONFLICTS1,
+	G2V_RESOLVE_CONFLICTS2,
+	G2V_INIT_FRACTIONS,
+	G2V_FRACTIONS_NEIGHBORS,
+	G2V_TUNE_FRACTIONS,
+	G2V_ADJUST_TYPES
+};
+
+/// a step of the processing schedule
+struct Gray2Vec_Step
+{
+	Gray2Vec_Step(const Gray2Vec_StepType Type, const double MaxError = -1.0) : type(Type), max_error(MaxError), checkpoint(false), loop(0), rounds(1) { };
+
+	Gray2Vec_StepType type;
+	/// maximum error parameter for G2V_TUNE_FRACTIONS
+	double max_error;
+	/// the step completes a stage, a checkpoint is written after it if enabled
+	bool checkpoint;
+	/// the step completes a round of the last loop steps (including this one),
+	/// the round is repeated until it converged (see Gray2Vec_Convergence)
+	/// or was run rounds times
+	int loop;
+	int rounds;
+};
+
+/// statistics collected while running a processing step
+struct Gray2Vec_Stats
+{
+	Gray2Vec_Stats() { clear(); };
+	void clear()
+	{
+		cnt_all = 0;
+		cnt_side = 0; cnt_side_n = 0; cnt_side_s = 0;
+		cnt_corner = 0; cnt_corner_n = 0; cnt_corner_s = 0;
+		cnt_corner2 = 0; cnt_corner2_n = 0; cnt_corner2_s = 0;
+		cnt_changed = 0; cnt_changed2 = 0; cnt_changed_type = 0;
+		cnt_tuned = 0;
+		df_max = 0.0; df_sum = 0.0; df_cnt = 0;
+	};
+	/// add statistics of another part of the grid
+	void add(const Gray2Vec_Stats &s)
+	{
+		cnt_all += s.cnt_all;
+		cnt_side += s.cnt_side; cnt_side_n += s.cnt_side_n; cnt_side_s += s.cnt_side_s;
+		cnt_corner += s.cnt_corner; cnt_corner_n += s.cnt_corner_n; cnt_corner_s += s.cnt_corner_s;
+		cnt_corner2 += s.cnt_corner2; cnt_corner2_n += s.cnt_corner2_n; cnt_corner2_s += s.cnt_corner2_s;
+		cnt_changed += s.cnt_changed; cnt_changed2 += s.cnt_changed2; cnt_changed_type += s.cnt_changed_type;
+		cnt_tuned += s.cnt_tuned;
+		if (s.df_max > df_max) df_max = s.df_max;
+		df_sum += s.df_sum; df_cnt += s.df_cnt;
+	};
+
+	size_t cnt_all;
+	size_t cnt_side;
+	size_t cnt_side_n;
+	size_t cnt_side_s;
+	size_t cnt_corner;
+	size_t cnt_corner_n;
+	size_t cnt_corner_s;
+	size_t cnt_corner2;
+	size_t cnt_corner2_n;
+	size_t cnt_corner2_s;
+	size_t cnt_changed;
+	size_t cnt_changed2;
+	size_t cnt_changed_type;
+	/// pixels (G2V_TUNE_FRACTIONS) or pairs (G2V_FRACTIONS_NEIGHBORS) with fractions changed
+	size_t cnt_tuned;
+
+	double df_max;
+	double df_sum;
+	size_t df_cnt;
+};
+
+/// criteria for ending the rounds of a repeated processing phase early (see
+/// Gray2Vec_Step::loop): a round is converged if compared to the previous round
+/// for all of its steps the maximum and average error changed by at most df_max
+/// and df_avg, the number of pairs by at most pairs and at most changed pixels
+/// were changed - negative values are not checked
+struct Gray2Vec_Convergence
+{
+	Gray2Vec_Convergence() : enabled(false), df_max(-1.0), df_avg(-1.0), changed(-1), pairs(-1) { };
+
+	/// if the statistics s of a step are converged compared to prev of the previous round
+	bool converged(const Gray2Vec_Stats &s, const Gray2Vec_Stats &prev) const
+	{
+		const double avg = (s.df_cnt > 0) ? s.df_sum/s.df_cnt : 0.0;
+		const double avg_prev = (prev.df_cnt > 0) ? prev.df_sum/prev.df_cnt : 0.0;
+		const long nChanged = s.cnt_changed + s.cnt_changed2 + s.cnt_changed_type + s.cnt_tuned;
+
+		if ((df_max >= 0) && (std::abs(s.df_max - prev.df_max) > df_max)) return false;
+		if ((df_avg >= 0) && (std::abs(avg - avg_prev) > df_avg)) return false;
+		if ((changed >= 0) && (nChanged > changed)) return false;
+		if ((pairs >= 0) && (std::abs(long(s.df_cnt/2) - long(prev.df_cnt/2)) > pairs)) return false;
+
+		return true;
+	};
+
+	bool enabled;
+	double df_max;
+	double df_avg;
+	long changed;
+	long pairs;
+};
+
+/// per pixel data needed for generating the polygon geometries
+struct Gray2Vec_Cell
+{
+	unsigned char n;
+	unsigned char f1;
+	unsigned char f2;
+	short f3;
+};
+
+/// data of a pixel of the reduced grid kept together in memory during the
+/// fraction steps with interleaved layout (see Gray2Vec_Grid::SetInterleave())
+struct Gray2Vec_Record
+{
+	short f3;
+	unsigned char s;
+	/// 4 bit state of the neighbourhood code (see Gray2Vec_CodePlane)
+	unsigned char n;
+	unsigned char f1;
+	unsigned char f2;
+};
+
+struct Gray2Vec_EdgeBand;
+struct Gray2Vec_Worklist;
+struct Gray2Vec_Wavefront;
+struct Gray2Vec_Rule;
+struct Gray2Vec_RuleIndex;
+
 class Gray2Vec_Grid
 {
  public:
-	Gray2Vec_Grid(const std::string file, const std::string file_c, const bool Complement, const bool Debug);
-	~Gray2Vec_Grid() { };
+	/// load image data - with Window > 0 only this number of reduced grid lines
+	/// are kept in memory and data is read while processing (streaming mode),
+	/// with Shards > 1 only the part of the image for shard number Shard is processed
+	Gray2Vec_Grid(const std::string file, const std::string file_c, const bool Complement, const bool Debug, const int Window = 0, const int Shard = 0, const int Shards = 1);
+	~Gray2Vec_Grid();
+	/// switch to a different input image (and combined image) of any size,
+	/// the settings and the memory allocated for processing are kept
+	void Open(const std::string file, const std::string file_c);
+
+	/// generate the standard processing schedule - the phases of tuning the
+	/// fractions are repeated Rounds times (standard numbers if Rounds <= 0)
+	static void StandardSchedule(std::vector<Gray2Vec_Step> &Steps, const double max_error, const int Rounds = 0);
+	/// run the processing steps - in streaming mode all steps have to be run
+	/// in a single call, they are then processed in parallel on a window of lines
+	void Process(const std::vector<Gray2Vec_Step> &Steps);
 
 	/// decides on the pixel classes based on the coverage fraction and the subpixel configuration
 	void Analyze();
@@ -69,38 +225,249 @@ class Gray2Vec_Grid
 	void FractionsNeighborsAdj();
 	/// vectorize the data and write polygons to an SQLite database
 	bool Vectorize(const std::string file, const std::string layer, const bool Append);
+	/// vectorize the data and write polygons to layer of an open vector dataset
+	bool Vectorize(GDALDatasetH hDS, const std::string layer);
+	/// create (or with Append open) the SQLite database to write polygons to
+	static GDALDatasetH OpenOutput(const std::string file, const bool Append);
+	static void CloseOutput(GDALDatasetH hDS);
+	/// number of bands of the input image
+	int BandCount() const { return m_poDataset->GetRasterCount(); };
+	/// process band Band (starting at 1) of the input image from now on,
+	/// results of previous processing are discarded
+	void SelectBand(const int Band);
 	/// set x/y/z attributes to be written with the vector data
 	void SetAttributes(const int Xc, const int Yc, const int Zc) { m_x = Xc; m_y = Yc; m_z = Zc; };
+	/// set number of threads to use for processing
+	void SetThreads(const int Threads);
+	/// keep the working planes in memory mapped files in directory dir
+	/// so the operating system can page them out if memory is short
+	void SetScratch(const std::string dir);
+	/// write checkpoints to file after the stages of processing, with Resume
+	/// processing continues from the checkpoint in file if there is one
+	void SetCheckpoint(const std::string file, const bool Resume) { m_checkpoint_file = file; m_resume = Resume; };
+	/// keep the input data after processing so the complement
+	/// can be processed with Complement() without reading it again
+	void SetDual(const bool Dual) { m_dual = Dual; };
+	/// keep the data of every pixel together in one record (Gray2Vec_Record)
+	/// instead of in separate planes during the fraction steps (not in streaming mode)
+	void SetInterleave(const bool Interleave) { m_interleave = Interleave; };
+	/// end repeated processing phases once converged (not in streaming mode)
+	void SetConvergence(const Gray2Vec_Convergence &Convergence) { m_convergence = Convergence; };
+	/// update the pixels in the neighbor adjustments in four classes of every second pixel
+	/// of every second line instead of in raster order - the classes are processed in
+	/// parallel and the result does not depend on the number of threads, it differs
+	/// slightly from the raster order though (not in streaming mode)
+	void SetCheckerboard(const bool Checkerboard) { m_checkerboard = Checkerboard; };
+	/// switch to processing the complement of the input (or back) reusing
+	/// the data already read, requires SetDual() and a combined image
+	void Complement();
 
  protected:
 	/// check if neighbourhood n covers direction d
 	static bool check_cover(int n, int d);
+	/// move px/py one pixel in direction dir (0: no move)
 	static void move_dir(int &px, int &py, const int dir);
-	static int side1(const int dir);
-	static int side2(const int dir);
+	/// first and second side the edge of a pixel with 4 bit state st runs to
+	static int side1(const int st);
+	static int side2(const int st);
+	/// number of lines above and below a step reads or modifies when processing a line
+	static int step_reach(const Gray2Vec_StepType type);
+	/// if the result of a step is independent of the order the lines are processed in
+	static bool step_parallel(const Gray2Vec_StepType type);
+	/// summary of the 2x2 full resolution pixels for the analysis (see m_img_q)
+	static unsigned char quad_summary(const int v1, const int v3, const int v7, const int v5);
+	/// quad summaries of the w quads of 2x2 pixels of the full resolution lines r0 and r1
+	static void quad_summary_row(const unsigned char *r0, const unsigned char *r1, unsigned char *q, const int w);
+
+	/// change the code of pixel px/py according to the first matching rule
+	/// (see Gray2Vec_Rule), returns false if no rule matches
+	bool apply_rules(const Gray2Vec_Rule *Rules, const Gray2Vec_RuleIndex &Index, const int px, const int py);
 
 	int share_sides(const int px1, const int py1, const int px2, const int py2);
 	int sides_connected(const int px, const int py);
 	int set_fraction(const int px, const int py);
 	double pixel_error(const int px, const int py, const bool use_adjust);
 
+	/// discard the results of previous processing so new input can be processed
+	void Reset();
+	/// move the pixel data to m_records (interleaved layout, see SetInterleave())
+	void Interleave();
+	/// move the pixel data back to the separate planes
+	void Deinterleave();
+	/// allocate the planes and read the input data (except in streaming mode)
+	void Load();
+	/// read input data for the reduced grid lines y0 to y1-1 and average the values
+	void LoadRows(const int y0, const int y1);
+	/// read and average the input image (first part of LoadRows())
+	void ReadRows(const int y0, const int y1);
+	/// average lines c0 to c1-1 of the full resolution lines in img starting with line y0
+	void AverageRows(CImg<unsigned char> *img, const int y0, const int c0, const int c1);
+	/// apply the combined image (second part of LoadRows())
+	void CombineRows(const int y0, const int y1);
+	/// add lines y0 to y1-1 of m_img_s to the block index, the index is started anew with y0 == 0
+	void IndexRows(const int y0, const int y1);
+	/// if block bx/by contains only empty or only full pixels
+	bool block_uniform(const int bx, const int by) const;
+
+	/// write the processing state after the first Done steps of Steps to the checkpoint file
+	void WriteCheckpoint(const std::vector<Gray2Vec_Step> &Steps, const size_t Done);
+	/// restore the processing state from the checkpoint file, returns the number of steps done
+	size_t ReadCheckpoint(const std::vector<Gray2Vec_Step> &Steps);
+
+	/// run all steps line by line on a moving window (streaming mode),
+	/// repeated phases are run for the full number of rounds
+	void ProcessStreaming(const std::vector<Gray2Vec_Step> &Schedule);
+	void BeginStep(const Gray2Vec_Step &Step);
+	/// run a step on line py - with Color >= 0 only on the pixels of
+	/// this color class of the checkerboard order (see SetCheckerboard())
+	void StepRow(const Gray2Vec_Step &Step, const int py, Gray2Vec_Stats &Stats, const bool Fractions, const int Color);
+	/// run a step on pixels x0 to x1-1 of line py skipping the pixels of uniform blocks
+	void StepSpan(const Gray2Vec_Step &Step, const int py, const int x0, const int x1, Gray2Vec_Stats &Stats, const bool Fractions, const int Color);
+	/// run a step on pixels x0 to x1-1 of line py (all of them in partial blocks)
+	void StepPixels(const Gray2Vec_Step &Step, const int py, const int x0, const int x1, Gray2Vec_Stats &Stats, const bool Fractions, const int Color);
+	/// the part of a step concerning pixels x0 to x1-1 of line py in uniform blocks
+	void StepUniform(const Gray2Vec_Step &Step, const int py, const int x0, const int x1, Gray2Vec_Stats &Stats);
+	/// run a step on lines y0 to y1-1 collecting statistics for every line separately,
+	/// with Work only on the spans of the lines in the worklist, with Color >= 0 only
+	/// on the lines of the color class adding to the statistics of the other classes
+	void StepRows(const Gray2Vec_Step &Step, const int y0, const int y1, Gray2Vec_Stats *RowStats, const bool Fractions, Gray2Vec_Worklist *Work, const int Color);
+	/// run a neighbor adjustment in raster order on all threads with a wavefront
+	/// over the lines (see Gray2Vec_Wavefront), the result is the same as running
+	/// it on the lines in sequence (see the check target of the makefile)
+	void StepWavefront(const Gray2Vec_Step &Step, Gray2Vec_Stats *RowStats, const bool Fractions);
+	/// lines t, t+n, ... of a wavefront for t from t0 to t1-1 with n threads in the pool
+	void StepRowsWavefront(const Gray2Vec_Step &Step, const int t0, const int t1, Gray2Vec_Stats *RowStats, const bool Fractions, Gray2Vec_Wavefront *Wave);
+	void EndStep(const Gray2Vec_Step &Step, const Gray2Vec_Stats &Stats, const Gray2Vec_Stats *Prev);
+
+	void AnalyzeRow(const int py);
+	/// the steps except for the analysis process pixels x0 to x1-1 of line py,
+	/// the neighbor adjustments only every dx-th of them
+	void OptimizeSidesRow(const int py, const int x0, const int x1, const int dx);
+	void SmoothEdgesRow(const int py, const int x0, const int x1, const int dx);
+	void ResolveConflictsRow1(const int py, const int x0, const int x1, const int dx, Gray2Vec_Stats &Stats, const bool Fractions);
+	void ResolveConflictsRow2(const int py, const int x0, const int x1, const int dx, Gray2Vec_Stats &Stats, const bool Fractions);
+	void NeighborsAdjust2Row(const int py, const int x0, const int x1, const int dx, Gray2Vec_Stats &Stats);
+	void InitFractionsRow(const int py, const int x0, const int x1, Gray2Vec_Stats &Stats);
+	void TuneFractionsRow(const int py, const int x0, const int x1, const double max_error, Gray2Vec_Stats &Stats);
+	void FractionsNeighborsAdjRow(const int py, const int x0, const int x1, Gray2Vec_Stats &Stats);
+
+	/// write the final data of line py to the spool file (streaming mode)
+	void SpoolRow(const int py);
+	/// final data of pixel px/py - from memory or the spool file
+	Gray2Vec_Cell GetCell(const int px, const int py);
+	/// get line iY of the subgrid used for vectorizing
+	void SubgridRow(const int iY, int *panLineVal);
+	/// number of subgrid lines to vectorize
+	int SubgridRows();
+
 	/// write out a polygon feature to the specified OGR layer
 	bool EmitPolygonToLayer(OGRLayerH hOutLayer, RPolygon *poRPoly);
-	/// vectorize the processed data using the helper grid img_h
-	bool Polygonize(CImg<unsigned char> &img_h, OGRLayerH hOutLayer);
+	/// vectorize the processed data generating the subgrid line by line
+	bool Polygonize(OGRLayerH hOutLayer);
+	/// multithreaded variant of Polygonize() producing identical results
+	bool PolygonizeThreaded(OGRLayerH hOutLayer);
+	/// second pass of PolygonizeThreaded() for a band of lines
+	void PolygonizeBand(Gray2Vec_EdgeBand *Band, GInt32 *panPolyIdMap);
 
 	double m_GeoTransform[6];
 	OGRSpatialReferenceH m_SRS;
 
 	bool m_debug;
+	bool m_complement;
+	/// keep input data for processing the complement (see SetDual())
+	bool m_dual;
+	/// use the interleaved layout for the fraction steps (see SetInterleave())
+	bool m_interleave;
+	/// run the neighbor adjustments in checkerboard order (see SetCheckerboard())
+	bool m_checkerboard;
+	/// criteria for ending repeated phases (see SetConvergence())
+	Gray2Vec_Convergence m_convergence;
+
+	std::string m_file;
+	std::string m_file_c;
+
+	GDALDataset *m_poDataset;
+	GDALDataset *m_poDataset2;
+	GDALRasterBand *m_poBand;
+	GDALRasterBand *m_poBand2;
+	/// band of the input image processed
+	int m_band;
+	/// background reader for the input image while loading
+	Gray2Vec_Reader *m_reader;
+
+	/// size of the reduced grid
+	int m_width;
+	int m_height;
+
+	/// number of lines kept in memory in streaming mode, zero otherwise
+	int m_window;
+
+	/// shard of the image to process and number of shards
+	int m_shard;
+	int m_shards;
+	/// first line of the input image in the reduced grid (non-zero for shards)
+	int m_row0;
+	/// lines of the reduced grid belonging to the shard, the others
+	/// are only processed to obtain the same results at the shard boundaries
+	int m_out0;
+	int m_out1;
+
+	/// number of threads to use
+	int m_threads;
+	/// threads for the loops over lines without dependencies between the lines
+	Gray2Vec_Pool *m_pool;
+
+	/// input data has been read
+	bool m_loaded;
+	/// fractions have been initialized
+	bool m_fractions;
+	/// processing has been run (streaming mode)
+	bool m_processed;
+
+	/// summary of the 2x2 full resolution pixels of every reduced pixel:
+	/// highest value corner (lower 4 bits) and side (upper 4 bits) as neighbourhood code
+	Gray2Vec_Plane<unsigned char> m_img_q;
+	Gray2Vec_Plane<unsigned char> m_img_s;
+	/// neighbourhood codes: 0: empty, 255: full, 1-8: corners (odd) and sides (even)
+	/// of small fractions, 11-17: corners of big fractions
+	Gray2Vec_CodePlane m_img_n;
+	Gray2Vec_Plane<unsigned char> m_img_f1;
+	Gray2Vec_Plane<unsigned char> m_img_f2;
+	Gray2Vec_Plane<short> m_img_f3;
+	Gray2Vec_Plane<unsigned char> m_img_e;
+	/// smallest and largest value of m_img_s in every block of BlockSize x BlockSize pixels
+	/// (the lines loaded so far in streaming mode), pixels of blocks with only a single
+	/// value of 0 or 255 (uniform blocks) are not changed by the processing steps
+	std::vector<unsigned char> m_block_min;
+	std::vector<unsigned char> m_block_max;
+	/// number of block columns
+	int m_blocks_x;
+	/// averages of the input before combination (with SetDual())
+	Gray2Vec_Plane<unsigned char> m_img_so;
+	/// pixel data of m_img_s, m_img_n and the fractions with interleaved layout,
+	/// the planes then refer to the fields of the records (see Interleave())
+	std::vector<Gray2Vec_Record> m_records;
+
+	/// sums of the 2x2 full resolution pixels of the combined image, kept
+	/// for further inputs using the same combined image (except in streaming mode)
+	Gray2Vec_Plane<unsigned short> m_img_c;
+	/// tiles of m_img_c read already (see CombineRows())
+	std::vector<bool> m_tiles_c;
+
+	/// temporary file holding the final results in streaming mode
+	std::string m_spool_file;
+	VSILFILE *m_spool;
+	/// lines of the spool file cached in memory (codes packed like in m_img_n)
+	CImg<unsigned char> m_spool_n;
+	CImg<unsigned char> m_spool_f1;
+	CImg<unsigned char> m_spool_f2;
+	CImg<short> m_spool_f3;
+	std::vector<int> m_spool_rows;
 
-	CImg<unsigned char> m_img;
-	CImg<unsigned char> m_img_s;
-	CImg<unsigned char> m_img_n;
-	CImg<unsigned char> m_img_h;
-	CImg<unsigned char> m_img_f1;
-	CImg<unsigned char> m_img_f2;
-	CImg<short> m_img_f3;
+	/// checkpoint file, empty if no checkpoints are written
+	std::string m_checkpoint_file;
+	/// continue from the checkpoint file when processing
+	bool m_resume;
 
 	int m_x;
 	int m_y;
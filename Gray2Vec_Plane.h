@@ -0,0 +1,338 @@
+/* ========================================================================
+    File: @(#)Gray2Vec_Plane.h
+   ------------------------------------------------------------------------
+    Image plane class for grayscale image vectorizer
+    Copyright (C) 2016 Christoph Hormann <chris_hormann@gmx.de>
+   ------------------------------------------------------------------------
+
+    This file is part of gray2vec
+
+    gray2vec is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    gray2vec is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with gray2vec.  If not, see <http://www.gnu.org/licenses/>.
+
+    Version history:
+
+      0.1: initial public version, November 2016,
+
+   ========================================================================
+ */
+
+#ifndef _Gray2Vec_Plane_H
+#define _Gray2Vec_Plane_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#define cimg_display 0
+
+#include "CImg.h"
+
+using namespace cimg_library;
+
+/// image plane addressed in image coordinates that can hold either
+/// the whole image or a window of consecutive lines of it - the pixel
+/// data can also be one field of an array of records (see share())
+template<typename T> class Gray2Vec_Plane
+{
+ public:
+	Gray2Vec_Plane() : m_width(0), m_height(0), m_y0(0), m_rows(0), m_base(NULL), m_pitch(sizeof(T)), m_map(NULL), m_map_size(0) { };
+	~Gray2Vec_Plane() { release(); };
+
+	/// keep the pixel data in memory mapped files in directory dir
+	/// instead of on the heap (for planes allocated afterwards)
+	void set_scratch(const std::string &dir) { m_scratch = dir; }
+
+	/// allocate plane for an image of width x height pixel
+	/// holding Rows lines in memory (all lines if Rows <= 0)
+	void assign(const int width, const int height, const int Rows = 0)
+	{
+		release();
+		m_width = width;
+		m_height = height;
+		m_y0 = 0;
+		m_rows = ((Rows > 0) && (Rows < height)) ? Rows : height;
+		if (!m_scratch.empty() && (width > 0) && (m_rows > 0))
+			map(width, m_rows);
+		else
+			m_img.assign(width, m_rows, 1, 1);
+		m_base = reinterpret_cast<unsigned char *>(m_img.data());
+		m_pitch = sizeof(T);
+	}
+
+	/// free the pixel data
+	void clear() { release(); m_img.assign(); m_width = 0; m_height = 0; m_y0 = 0; m_rows = 0; m_base = NULL; m_pitch = sizeof(T); }
+
+	/// use the memory at data with pitch bytes from one pixel to the next
+	/// as pixel data for the whole image of width x height pixel
+	void view(const int width, const int height, unsigned char *data, const size_t pitch)
+	{
+		release();
+		m_img.assign();
+		m_width = width;
+		m_height = height;
+		m_y0 = 0;
+		m_rows = height;
+		m_base = data;
+		m_pitch = pitch;
+	}
+
+	/// move the pixel data of the whole image to the memory at data with
+	/// pitch bytes from one pixel to the next (one field of an array of records)
+	void share(unsigned char *data, const size_t pitch)
+	{
+		for (int y = 0; y < m_rows; y++)
+			for (int x = 0; x < m_width; x++)
+				*reinterpret_cast<T *>(data + ((size_t)y*m_width + x)*pitch) = (*this)(x, y+m_y0);
+		view(m_width, m_height, data, pitch);
+	}
+
+	/// move the pixel data back from the memory set with share() to the plane
+	void unshare()
+	{
+		if (!shared()) return;
+		unsigned char *data = m_base;
+		const size_t pitch = m_pitch;
+		assign(m_width, m_height);
+		for (int y = 0; y < m_rows; y++)
+			for (int x = 0; x < m_width; x++)
+				(*this)(x, y) = *reinterpret_cast<T *>(data + ((size_t)y*m_width + x)*pitch);
+	}
+
+	/// if the pixel data is not held by the plane itself (see view())
+	bool shared() const { return (m_base != NULL) && (m_img.data() == NULL); }
+	/// bytes from one pixel to the next
+	size_t pitch() const { return m_pitch; }
+
+	T &operator()(const int x, const int y) { return *reinterpret_cast<T *>(m_base + ((size_t)(y-m_y0)*m_width + x)*m_pitch); }
+
+	/// width of the image
+	int width() const { return m_width; }
+	/// height of the image (not the number of lines held in memory)
+	int height() const { return m_height; }
+	/// first line held in memory
+	int first_row() const { return m_y0; }
+	/// number of lines held in memory
+	int rows() const { return m_rows; }
+
+	/// pointer to the data of line y (not for shared planes)
+	T *row(const int y) { return m_img.data() + (size_t)(y-m_y0)*m_width; }
+
+	/// move the window forward so it starts with line y0,
+	/// data of lines remaining inside the window is kept (not for shared planes)
+	void scroll(const int y0)
+	{
+		if (y0 <= m_y0) return;
+		const int d = y0-m_y0;
+		if (d < m_img.height())
+			std::memmove(m_img.data(), m_img.data() + (size_t)d*m_width, (size_t)(m_img.height()-d)*m_width*sizeof(T));
+		m_y0 = y0;
+	}
+
+	/// the lines currently held in memory as a CImg (not for shared planes)
+	CImg<T> &image() { return m_img; }
+
+ protected:
+	/// allocate the pixel data in a scratch file that is
+	/// deleted right away and only exists while it is mapped
+	void map(const int width, const int rows)
+	{
+		std::string file = m_scratch + "/gray2vec-XXXXXX";
+
+		const int fd = mkstemp(&file[0]);
+
+		if (fd < 0)
+		{
+			std::fprintf(stderr,"  creating scratch file in %s failed.\n\n", m_scratch.c_str());
+			std::exit(1);
+		}
+
+		unlink(file.c_str());
+
+		m_map_size = size_t(width)*rows*sizeof(T);
+
+		if (ftruncate(fd, m_map_size) == 0)
+			m_map = mmap(NULL, m_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+		close(fd);
+
+		if ((m_map == NULL) || (m_map == MAP_FAILED))
+		{
+			std::fprintf(stderr,"  mapping scratch file in %s failed.\n\n", m_scratch.c_str());
+			std::exit(1);
+		}
+
+		m_img.assign(static_cast<T *>(m_map), width, rows, 1, 1, true);
+	}
+
+	/// unmap the scratch file if there is one
+	void release()
+	{
+		if (m_map == NULL) return;
+		m_img.assign();
+		munmap(m_map, m_map_size);
+		m_map = NULL;
+		m_map_size = 0;
+	}
+
+	CImg<T> m_img;
+
+	int m_width;
+	int m_height;
+	int m_y0;
+	int m_rows;
+
+	/// pixel data (m_img or memory set with view()) and bytes from one pixel to the next
+	unsigned char *m_base;
+	size_t m_pitch;
+
+	/// directory for scratch files, empty to use the heap
+	std::string m_scratch;
+	void *m_map;
+	size_t m_map_size;
+
+ private:
+	Gray2Vec_Plane(const Gray2Vec_Plane &);
+	Gray2Vec_Plane &operator=(const Gray2Vec_Plane &);
+};
+
+/// neighbourhood codes (see Gray2Vec_Grid::m_img_n) in the order of their 4 bit states
+static constexpr unsigned char Gray2Vec_StateCode[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 11, 13, 15, 17, 255, 0, 0 };
+
+/// 4 bit states of the neighbourhood codes
+struct Gray2Vec_CodeStates
+{
+	unsigned char state[256];
+};
+
+static constexpr Gray2Vec_CodeStates make_code_states()
+{
+	Gray2Vec_CodeStates States = {};
+	for (int i = 1; i < 14; i++)
+		States.state[Gray2Vec_StateCode[i]] = i;
+	return States;
+}
+
+static constexpr Gray2Vec_CodeStates Gray2Vec_CodeState = make_code_states();
+
+/// plane of neighbourhood codes stored as 4 bit states, two pixels per byte
+/// (or one per record when shared) - pixels are addressed with their codes
+/// like in a Gray2Vec_Plane
+class Gray2Vec_CodePlane
+{
+ public:
+	/// reference to the code of a pixel
+	class Ref
+	{
+	 public:
+		Ref(unsigned char &b, const int shift) : m_b(b), m_shift(shift) { };
+
+		operator unsigned char() const { return Gray2Vec_StateCode[state()]; }
+		Ref &operator=(const int n)
+		{
+			m_b = (m_b & ~(15 << m_shift)) | (Gray2Vec_CodeState.state[n] << m_shift);
+			return *this;
+		}
+		Ref &operator=(const Ref &r) { return *this = int(r); }
+
+		/// 4 bit state of the pixel
+		int state() const { return (m_b >> m_shift) & 15; }
+
+	 protected:
+		unsigned char &m_b;
+		const int m_shift;
+	};
+
+	Gray2Vec_CodePlane() : m_width(0), m_pack(1) { };
+
+	/// see Gray2Vec_Plane
+	void set_scratch(const std::string &dir) { m_data.set_scratch(dir); }
+	void assign(const int width, const int height, const int Rows = 0) { m_width = width; m_pack = 1; m_data.assign((width+1)/2, height, Rows); }
+	void clear() { m_data.clear(); m_width = 0; m_pack = 1; }
+	void scroll(const int y0) { m_data.scroll(y0); }
+
+	/// move the states to the memory at data with pitch bytes from one pixel to the next
+	void share(unsigned char *data, const size_t pitch)
+	{
+		const int height = m_data.height();
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < m_width; x++)
+				data[((size_t)y*m_width + x)*pitch] = state(x, y);
+		m_data.view(m_width, height, data, pitch);
+		m_pack = 0;
+	}
+
+	/// pack the states again after share()
+	void unshare()
+	{
+		if (m_pack) return;
+		const unsigned char *data = &m_data(0, 0);
+		const size_t pitch = m_data.pitch();
+		m_data.assign((m_width+1)/2, m_data.height());
+		m_pack = 1;
+		for (int y = 0; y < m_data.height(); y++)
+			for (int x = 0; x < m_width; x += 2)
+			{
+				const size_t i = ((size_t)y*m_width + x)*pitch;
+				m_data(x/2, y) = data[i] | ((x+1 < m_width) ? data[i+pitch] << 4 : 0);
+			}
+	}
+
+	Ref operator()(const int x, const int y) { return Ref(m_data(x >> m_pack, y), (x & m_pack)*4); }
+	/// 4 bit state of pixel x/y
+	int state(const int x, const int y) { return (m_data(x >> m_pack, y) >> ((x & m_pack)*4)) & 15; }
+
+	int width() const { return m_width; }
+	int height() const { return m_data.height(); }
+	int first_row() const { return m_data.first_row(); }
+	int rows() const { return m_data.rows(); }
+
+	/// pointer to the packed states of line y (not when shared)
+	unsigned char *row(const int y) { return m_data.row(y); }
+
+	/// unpack the codes of line y to n
+	void get_row(const int y, unsigned char *n)
+	{
+		for (int x = 0; x < m_width; x++)
+			n[x] = Gray2Vec_StateCode[state(x, y)];
+	}
+
+	/// the packed states (for saving and restoring them, not when shared)
+	Gray2Vec_Plane<unsigned char> &packed() { return m_data; }
+
+	/// the codes of the lines currently held in memory as a CImg
+	CImg<unsigned char> image()
+	{
+		CImg<unsigned char> img(m_width, rows(), 1, 1);
+		for (int y = 0; y < rows(); y++)
+			get_row(first_row()+y, img.data(0, y));
+		return img;
+	}
+
+ protected:
+	Gray2Vec_Plane<unsigned char> m_data;
+	int m_width;
+	/// 1 if two pixels are packed in a byte, 0 when shared
+	int m_pack;
+
+ private:
+	Gray2Vec_CodePlane(const Gray2Vec_CodePlane &);
+	Gray2Vec_CodePlane &operator=(const Gray2Vec_CodePlane &);
+};
+
+#endif /* _Gray2Vec_Plane_H */
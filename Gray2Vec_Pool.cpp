@@ -0,0 +1,151 @@
+/* ========================================================================
+    File: @(#)Gray2Vec_Pool.cpp
+   ------------------------------------------------------------------------
+    Thread pool for grayscale image vectorizer
+    Copyright (C) 2016 Christoph Hormann <chris_hormann@gmx.de>
+   ------------------------------------------------------------------------
+
+    This file is part of gray2vec
+
+    gray2vec is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    gray2vec is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with gray2vec.  If not, see <http://www.gnu.org/licenses/>.
+
+    Version history:
+
+      0.1: initial public version, November 2016,
+
+   ========================================================================
+ */
+
+#include <algorithm>
+
+#include "Gray2Vec_Pool.h"
+
+Gray2Vec_Pool::Gray2Vec_Pool(const int Threads)
+	: m_queues(std::max(Threads, 1)), m_func(NULL), m_lines(0), m_chunk(1), m_round(0), m_running(0), m_stop(false)
+{
+	for (size_t t = 0; t < m_queues.size(); t++)
+	{
+		m_queues[t].first = 0;
+		m_queues[t].last = 0;
+	}
+
+	// thread 0 is the one calling Run()
+	for (int t = 1; t < threads(); t++)
+		m_threads.push_back(std::thread(&Gray2Vec_Pool::Worker, this, t));
+}
+
+Gray2Vec_Pool::~Gray2Vec_Pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_cond.notify_all();
+
+	for (size_t t = 0; t < m_threads.size(); t++)
+		m_threads[t].join();
+}
+
+void Gray2Vec_Pool::Run(const int Lines, const int Chunk, const std::function<void(const int, const int)> &Func)
+{
+	if (Lines <= 0) return;
+
+	const int T = threads();
+	const int nChunk = std::max(Chunk, 1);
+	const int nCount = (Lines + nChunk - 1)/nChunk;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		m_func = &Func;
+		m_lines = Lines;
+		m_chunk = nChunk;
+
+		// equal shares of consecutive chunks
+		for (int t = 0; t < T; t++)
+		{
+			std::lock_guard<std::mutex> qlock(m_queues[t].mutex);
+			m_queues[t].first = (size_t(nCount)*t)/T;
+			m_queues[t].last = (size_t(nCount)*(t+1))/T;
+		}
+
+		m_running = T-1;
+		m_round++;
+	}
+	m_cond.notify_all();
+
+	Work(0);
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	while (m_running > 0)
+		m_done.wait(lock);
+
+	m_func = NULL;
+}
+
+void Gray2Vec_Pool::Worker(const int t)
+{
+	int Round = 0;
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	while (true)
+	{
+		while (!m_stop && (m_round == Round))
+			m_cond.wait(lock);
+
+		if (m_stop) break;
+
+		Round = m_round;
+
+		lock.unlock();
+
+		Work(t);
+
+		lock.lock();
+
+		if (--m_running == 0)
+			m_done.notify_all();
+	}
+}
+
+void Gray2Vec_Pool::Work(const int t)
+{
+	int c;
+
+	while (Take(t, c))
+		(*m_func)(c*m_chunk, std::min(m_lines, (c+1)*m_chunk));
+}
+
+bool Gray2Vec_Pool::Take(const int t, int &c)
+{
+	const int T = threads();
+
+	// own chunks from the front, those of the others from the back
+	for (int i = 0; i < T; i++)
+	{
+		Queue &Q = m_queues[(t+i) % T];
+
+		std::lock_guard<std::mutex> lock(Q.mutex);
+
+		if (Q.first < Q.last)
+		{
+			c = (i == 0) ? Q.first++ : --Q.last;
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,98 @@
+/* ========================================================================
+    File: @(#)Gray2Vec_Pool.h
+   ------------------------------------------------------------------------
+    Thread pool for grayscale image vectorizer
+    Copyright (C) 2016 Christoph Hormann <chris_hormann@gmx.de>
+   ------------------------------------------------------------------------
+
+    This file is part of gray2vec
+
+    gray2vec is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    gray2vec is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with gray2vec.  If not, see <http://www.gnu.org/licenses/>.
+
+    Version history:
+
+      0.1: initial public version, November 2016,
+
+   ========================================================================
+ */
+
+#ifndef _Gray2Vec_Pool_H
+#define _Gray2Vec_Pool_H
+
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/// threads running loops over lines in chunks of consecutive lines.  Every
+/// thread starts with an equal share of the chunks and takes them from the
+/// front, once it has none left it takes chunks from the back of the shares
+/// of the other threads (work stealing).  The thread calling Run() takes
+/// part in the work so a pool of one thread runs everything in sequence.
+class Gray2Vec_Pool
+{
+ public:
+	/// pool of Threads threads (including the calling thread)
+	explicit Gray2Vec_Pool(const int Threads);
+	~Gray2Vec_Pool();
+
+	/// run Func(y0, y1) for lines 0 to Lines-1 in chunks of Chunk lines
+	/// and wait for all of them to be finished.  A chunk may wait for others
+	/// only if there are no more chunks than threads: a thread only takes
+	/// another chunk once it has finished one, so all of them get started.
+	void Run(const int Lines, const int Chunk, const std::function<void(const int, const int)> &Func);
+
+	/// number of threads including the calling thread
+	int threads() const { return m_queues.size(); }
+
+ protected:
+	/// the chunks of a thread not taken yet: first to last-1
+	struct Queue
+	{
+		std::mutex mutex;
+		int first;
+		int last;
+	};
+
+	void Worker(const int t);
+	/// process chunks until there are none left, starting with the ones of thread t
+	void Work(const int t);
+	/// take the next chunk of thread t or one from another thread
+	bool Take(const int t, int &c);
+
+	std::vector<Queue> m_queues;
+
+	/// the loop currently run
+	const std::function<void(const int, const int)> *m_func;
+	int m_lines;
+	int m_chunk;
+
+	/// number of the current loop for waking up the threads
+	int m_round;
+	/// threads still working on the current loop
+	int m_running;
+	bool m_stop;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::condition_variable m_done;
+	std::vector<std::thread> m_threads;
+
+ private:
+	Gray2Vec_Pool(const Gray2Vec_Pool &);
+	Gray2Vec_Pool &operator=(const Gray2Vec_Pool &);
+};
+
+#endif /* _Gray2Vec_Pool_H */
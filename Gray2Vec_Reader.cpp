@@ -0,0 +1,172 @@
+/* ========================================================================
+    File: @(#)Gray2Vec_Reader.cpp
+   ------------------------------------------------------------------------
+    Background raster reader for grayscale image vectorizer
+    Copyright (C) 2016 Christoph Hormann <chris_hormann@gmx.de>
+   ------------------------------------------------------------------------
+
+    This file is part of gray2vec
+
+    gray2vec is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    gray2vec is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with gray2vec.  If not, see <http://www.gnu.org/licenses/>.
+
+    Version history:
+
+      0.1: initial public version, November 2016,
+
+   ========================================================================
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "Gray2Vec_Reader.h"
+
+// minimum number of lines read at a time
+static const int ReaderLines = 64;
+
+Gray2Vec_Reader::Gray2Vec_Reader(const std::string file, const int Band, const int y0, const int y1, const int Threads)
+	: m_file(file), m_band(Band), m_y0(y0), m_y1(y1), m_next(0), m_first(0), m_stop(false), m_error(false)
+{
+	GDALDataset *poDataset = static_cast<GDALDataset *>(GDALOpen( file.c_str(), GA_ReadOnly ));
+
+	if (poDataset == NULL)
+	{
+		std::fprintf(stderr,"  opening file %s failed.\n\n", file.c_str());
+		std::exit(1);
+	}
+
+	GDALRasterBand *poBand = poDataset->GetRasterBand(m_band);
+
+	int nBlockX, nBlockY;
+	poBand->GetBlockSize(&nBlockX, &nBlockY);
+
+	m_width = poBand->GetXSize();
+
+	GDALClose(poDataset);
+
+	// whole blocks and at least ReaderLines lines
+	nBlockY = std::max(nBlockY, 1);
+	m_lines = ((ReaderLines + nBlockY - 1)/nBlockY)*nBlockY;
+
+	m_base = (m_y0/nBlockY)*nBlockY;
+	m_count = (m_y1 > m_y0) ? (m_y1 - m_base + m_lines - 1)/m_lines : 0;
+
+	const int nThreads = std::max(Threads, 1);
+
+	// one chunk in use and two for every thread to fill
+	m_chunks.resize(2*nThreads + 1);
+	for (size_t i = 0; i < m_chunks.size(); i++)
+	{
+		m_chunks[i].index = -1;
+		m_chunks[i].ready = false;
+	}
+
+	for (int t = 0; t < nThreads; t++)
+		m_threads.push_back(std::thread(&Gray2Vec_Reader::Worker, this));
+}
+
+Gray2Vec_Reader::~Gray2Vec_Reader()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_cond.notify_all();
+
+	for (size_t t = 0; t < m_threads.size(); t++)
+		m_threads[t].join();
+}
+
+void Gray2Vec_Reader::Worker()
+{
+	// GDAL datasets must not be used from several threads at the same time
+	GDALDataset *poDataset = static_cast<GDALDataset *>(GDALOpen( m_file.c_str(), GA_ReadOnly ));
+	GDALRasterBand *poBand = (poDataset != NULL) ? poDataset->GetRasterBand(m_band) : NULL;
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	while (true)
+	{
+		while (!m_stop && !((m_next < m_count) && (m_next < m_first + int(m_chunks.size()))))
+			m_cond.wait(lock);
+
+		if (m_stop) break;
+
+		const int c = m_next++;
+		Chunk &Ch = m_chunks[c % m_chunks.size()];
+
+		Ch.index = c;
+		Ch.ready = false;
+
+		lock.unlock();
+
+		const int y0 = chunk_start(c);
+		const int y1 = chunk_end(c);
+
+		Ch.data.resize(size_t(m_width)*m_lines);
+
+		bool Res = (poBand != NULL);
+
+		if (Res && (poBand->RasterIO(GF_Read, 0, y0, m_width, y1-y0, &Ch.data[0], m_width, y1-y0, GDT_Byte, 0, 0) != CE_None))
+			Res = false;
+
+		lock.lock();
+
+		if (!Res) m_error = true;
+		Ch.ready = true;
+		m_cond.notify_all();
+	}
+
+	lock.unlock();
+
+	if (poDataset != NULL) GDALClose(poDataset);
+}
+
+bool Gray2Vec_Reader::Read(unsigned char *buf, const int y0, const int y1)
+{
+	int y = y0;
+
+	while (y < y1)
+	{
+		const int c = (y - m_base)/m_lines;
+		Chunk &Ch = m_chunks[c % m_chunks.size()];
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		while (!m_error && !((Ch.index == c) && Ch.ready))
+			m_cond.wait(lock);
+
+		if (m_error) return false;
+
+		lock.unlock();
+
+		const int cy0 = chunk_start(c);
+		const int cy1 = std::min(chunk_end(c), y1);
+
+		std::memcpy(buf + size_t(y-y0)*m_width, &Ch.data[0] + size_t(y-cy0)*m_width, size_t(cy1-y)*m_width);
+
+		y = cy1;
+
+		// the chunk can be reused once all of its lines are requested
+		if (y == chunk_end(c))
+		{
+			lock.lock();
+			m_first = c+1;
+			m_cond.notify_all();
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,96 @@
+/* ========================================================================
+    File: @(#)Gray2Vec_Reader.h
+   ------------------------------------------------------------------------
+    Background raster reader for grayscale image vectorizer
+    Copyright (C) 2016 Christoph Hormann <chris_hormann@gmx.de>
+   ------------------------------------------------------------------------
+
+    This file is part of gray2vec
+
+    gray2vec is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    gray2vec is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with gray2vec.  If not, see <http://www.gnu.org/licenses/>.
+
+    Version history:
+
+      0.1: initial public version, November 2016,
+
+   ========================================================================
+ */
+
+#ifndef _Gray2Vec_Reader_H
+#define _Gray2Vec_Reader_H
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <gdal_priv.h>
+
+/// reads lines of a raster band in chunks aligned to the blocks of the band
+/// on background threads ahead of them being requested.  Every thread uses
+/// its own dataset handle so reading and decompression run in parallel.
+class Gray2Vec_Reader
+{
+ public:
+	/// read lines y0 to y1-1 of band Band of file using Threads threads
+	Gray2Vec_Reader(const std::string file, const int Band, const int y0, const int y1, const int Threads);
+	~Gray2Vec_Reader();
+
+	/// copy lines y0 to y1-1 to buf - lines have to be requested in sequence
+	bool Read(unsigned char *buf, const int y0, const int y1);
+
+ protected:
+	/// lines read at a time
+	struct Chunk
+	{
+		int index;
+		bool ready;
+		std::vector<unsigned char> data;
+	};
+
+	void Worker();
+	/// first line of chunk c
+	int chunk_start(const int c) const { return std::max(m_y0, m_base + c*m_lines); }
+	int chunk_end(const int c) const { return std::min(m_y1, m_base + (c+1)*m_lines); }
+
+	std::string m_file;
+	int m_band;
+	int m_width;
+
+	/// lines to read
+	int m_y0;
+	int m_y1;
+	/// chunks are aligned to multiples of m_lines starting at m_base
+	int m_base;
+	int m_lines;
+	int m_count;
+
+	/// chunks held in memory, chunk c uses m_chunks[c % m_chunks.size()]
+	std::vector<Chunk> m_chunks;
+	/// next chunk to read
+	int m_next;
+	/// first chunk not completely requested yet
+	int m_first;
+
+	bool m_stop;
+	bool m_error;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::vector<std::thread> m_threads;
+};
+
+#endif /* _Gray2Vec_Reader_H */
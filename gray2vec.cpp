@@ -29,6 +29,7 @@
 
 const char PROGRAM_TITLE[] = "gray2vec version 0.1";
 
+#include <cstdio>
 #include <cstdlib>
 #include <algorithm>
 #include <stack>
@@ -36,6 +37,63 @@ const char PROGRAM_TITLE[] = "gray2vec version 0.1";
 
 #include "Gray2Vec_Grid.h"
 
+/// entry of the batch manifest
+struct Gray2Vec_Tile
+{
+	std::string file;
+	std::string file_c;
+	int x;
+	int y;
+	int z;
+};
+
+/// read batch manifest with lines 'input x y z [combined]', combined
+/// defaults to file_c, empty lines and lines starting with '#' are ignored
+static void read_manifest(const std::string &file, const std::string &file_c, std::vector<Gray2Vec_Tile> &Tiles)
+{
+	FILE *fp = std::fopen(file.c_str(), "r");
+
+	if (fp == NULL)
+	{
+		std::fprintf(stderr,"Opening batch manifest %s failed.\n\n", file.c_str());
+		std::exit(1);
+	}
+
+	char Line[4096];
+	char File[4096];
+	char FileC[4096];
+	int nLine = 0;
+
+	while (std::fgets(Line, sizeof(Line), fp) != NULL)
+	{
+		nLine++;
+
+		Gray2Vec_Tile Tile;
+
+		const int n = std::sscanf(Line, "%4095s %d %d %d %4095s", File, &Tile.x, &Tile.y, &Tile.z, FileC);
+
+		if ((n <= 0) || (File[0] == '#')) continue;
+
+		if (n < 4)
+		{
+			std::fprintf(stderr,"Invalid line %d in batch manifest %s, expecting 'input x y z [combined]'.\n\n", nLine, file.c_str());
+			std::exit(1);
+		}
+
+		Tile.file = File;
+		Tile.file_c = (n == 5) ? FileC : file_c;
+		Tiles.push_back(Tile);
+	}
+
+	std::fclose(fp);
+
+	if (Tiles.empty())
+	{
+		std::fprintf(stderr,"Batch manifest %s does not contain any tiles.\n\n", file.c_str());
+		std::exit(1);
+	}
+}
+
 int main(int argc,char **argv)
 {
 	std::fprintf(stderr,"%s\n", PROGRAM_TITLE);
@@ -56,63 +114,324 @@ int main(int argc,char **argv)
 
 	const std::string Layer = cimg_option("-l","polygons","output layer");
 
+	const std::string Bands = cimg_option("-bands","","bands of the input image to process ('all' or comma separated list), each one written to layer <layer>_<band>");
+
+	const std::string Stack = cimg_option("-stack","","input images to process with the same combined image instead of -i (comma separated list), each one written to layer <layer>_<n>");
+
 	const int Xc = cimg_option("-x",-1,"x attribute to apply to generated polygons");
 	const int Yc = cimg_option("-y",-1,"y attribute to apply to generated polygons");
 	const int Zc = cimg_option("-z",-1,"z attribute to apply to generated polygons");
 
+	const std::string Batch = cimg_option("-batch","","manifest of tiles to process into the output layer (lines 'input x y z [combined]')");
+
 	const bool Complement = cimg_option("-complement",false,"process complement of input");
 
+	const bool Dual = cimg_option("-dual",false,"process input and its complement, writing the complement to layer <layer>_complement");
+
 	const bool Append = cimg_option("-append",false,"append to existing vector file");
 
 	const double MaxError = cimg_option("-me",0.05,"maximum error to accept for pixel coverage fraction");
 
+	const std::string Converge = cimg_option("-converge","","end the fraction tuning phases once converged: limits for the change of maximum and average error, changed pixels and change of pairs per round (comma separated, negative or omitted ones are not checked)");
+
+	const int Rounds = cimg_option("-rounds",0,"rounds of the fraction tuning phases (maximum with -converge, default: 6 for the first and 3 for the later phases)");
+
+	const int Window = cimg_option("-stream",0,"process image in streaming mode keeping the specified number of lines in memory");
+
+	const int Threads = cimg_option("-threads",1,"number of threads to use");
+
+	const std::string Shard = cimg_option("-shard","","process only part i/n of the image for merging with gray2vec-merge (i from 0 to n-1)");
+
+	const std::string Scratch = cimg_option("-scratch","","directory for memory mapped scratch files holding the working data");
+
+	const std::string Layout = cimg_option("-layout","planar","memory layout of the pixel data for the fraction tuning: planar or interleaved");
+
+	const std::string Order = cimg_option("-order","raster","order of updating the pixels in the neighbor adjustments: raster or checkerboard");
+
+	const std::string Checkpoint = cimg_option("-checkpoint","","file to write checkpoints to after the processing stages");
+	const bool Resume = cimg_option("-resume",false,"resume processing from the checkpoint file");
+
 	const bool Debug = cimg_option("-debug",false,"generate debug output");
 
-	if (file_i.empty() || file_o.empty())
+	if ((file_i.empty() && Batch.empty() && Stack.empty()) || file_o.empty())
 	{
 		std::fprintf(stderr,"You must specify input and output files (try '%s -h').\n\n",argv[0]);
 		std::exit(1);
 	}
 
-	Gray2Vec_Grid g2v(file_i, file_c, Complement, Debug);
+	int ShardI = 0;
+	int ShardN = 1;
+
+	if (!Shard.empty())
+	{
+		if ((std::sscanf(Shard.c_str(), "%d/%d", &ShardI, &ShardN) != 2) || (ShardN < 1) || (ShardI < 0) || (ShardI >= ShardN))
+		{
+			std::fprintf(stderr,"Invalid shard specification '%s', expecting i/n with 0 <= i < n.\n\n", Shard.c_str());
+			std::exit(1);
+		}
+	}
+
+	if (Dual && (file_c.empty() || Complement || (Window > 0) || !Batch.empty() || !Stack.empty() || !Bands.empty() || !Checkpoint.empty()))
+	{
+		std::fprintf(stderr,"-dual requires a combined image and cannot be combined with -complement, -stream, -batch, -stack, -bands and -checkpoint.\n\n");
+		std::exit(1);
+	}
+
+	if ((Layout != "planar") && (Layout != "interleaved"))
+	{
+		std::fprintf(stderr,"Invalid layout '%s', expecting planar or interleaved.\n\n", Layout.c_str());
+		std::exit(1);
+	}
+
+	if ((Layout == "interleaved") && ((Window > 0) || !Scratch.empty()))
+	{
+		std::fprintf(stderr,"The interleaved layout cannot be combined with -stream and -scratch.\n\n");
+		std::exit(1);
+	}
+
+	if ((Order != "raster") && (Order != "checkerboard"))
+	{
+		std::fprintf(stderr,"Invalid order '%s', expecting raster or checkerboard.\n\n", Order.c_str());
+		std::exit(1);
+	}
+
+	if ((Order == "checkerboard") && (Window > 0))
+	{
+		std::fprintf(stderr,"The checkerboard order cannot be combined with -stream.\n\n");
+		std::exit(1);
+	}
+
+	Gray2Vec_Convergence Convergence;
+
+	if (!Converge.empty())
+	{
+		if (std::sscanf(Converge.c_str(), "%lf,%lf,%ld,%ld", &Convergence.df_max, &Convergence.df_avg, &Convergence.changed, &Convergence.pairs) < 1)
+		{
+			std::fprintf(stderr,"Invalid convergence criteria '%s', expecting comma separated limits for max error, average error, changed pixels and pairs.\n\n", Converge.c_str());
+			std::exit(1);
+		}
+
+		Convergence.enabled = true;
+
+		// the shards could end the tuning after different numbers of rounds
+		if (ShardN > 1)
+		{
+			std::fprintf(stderr,"-converge cannot be combined with -shard.\n\n");
+			std::exit(1);
+		}
+	}
+
+	std::vector<Gray2Vec_Tile> Tiles;
+
+	if (!Batch.empty())
+	{
+		if (!Bands.empty() || !Stack.empty() || !Checkpoint.empty())
+		{
+			std::fprintf(stderr,"Batch mode cannot be combined with -bands, -stack and -checkpoint.\n\n");
+			std::exit(1);
+		}
+
+		read_manifest(Batch, file_c, Tiles);
+	}
+
+	std::vector<std::string> StackList;
+
+	if (!Stack.empty())
+	{
+		if (file_c.empty() || !Bands.empty())
+		{
+			std::fprintf(stderr,"-stack requires a combined image and cannot be combined with -bands.\n\n");
+			std::exit(1);
+		}
+
+		size_t p0 = 0;
+
+		while (true)
+		{
+			const size_t p1 = Stack.find(',', p0);
+			StackList.push_back(Stack.substr(p0, (p1 == std::string::npos) ? std::string::npos : p1-p0));
+			if (p1 == std::string::npos) break;
+			p0 = p1+1;
+		}
+	}
+
+	std::string file_first = file_i;
+
+	if (!Tiles.empty()) file_first = Tiles[0].file;
+	else if (!StackList.empty()) file_first = StackList[0];
+
+	Gray2Vec_Grid g2v(file_first, Tiles.empty() ? file_c : Tiles[0].file_c, Complement, Debug, Window, ShardI, ShardN);
 
 	if ((Xc >= 0) || (Yc >= 0) || (Zc >= 0))
 		g2v.SetAttributes(Xc, Yc, Zc);
 
-	g2v.Analyze();
-	g2v.NeighborsAdjust();
-	g2v.ResolveConflicts();
-	g2v.InitFractions();
-	g2v.FractionsNeighborsAdj();
-	g2v.TuneFractions();
-	g2v.FractionsNeighborsAdj();
-	g2v.TuneFractions();
-	g2v.FractionsNeighborsAdj();
-	g2v.TuneFractions();
-	g2v.FractionsNeighborsAdj();
-	g2v.TuneFractions();
-	g2v.FractionsNeighborsAdj();
-	g2v.TuneFractions();
-	g2v.FractionsNeighborsAdj();
-	g2v.TuneFractions();
-	g2v.NeighborsAdjust2();
-	g2v.ResolveConflicts();
-	g2v.FractionsNeighborsAdj();
-	g2v.TuneFractions();
-	g2v.FractionsNeighborsAdj();
-	g2v.TuneFractions();
-	g2v.FractionsNeighborsAdj();
-	g2v.TuneFractions();
-	g2v.NeighborsAdjust2();
-	g2v.ResolveConflicts();
-	g2v.FractionsNeighborsAdj();
-	g2v.TuneFractions();
-	g2v.FractionsNeighborsAdj();
-	g2v.TuneFractions();
-	g2v.FractionsNeighborsAdj();
-	g2v.TuneFractions();
-	g2v.FractionsNeighborsAdj();
-	g2v.TuneFractions(MaxError);
-
-	g2v.Vectorize(file_o, Layer, Append);
+	g2v.SetThreads(Threads);
+
+	g2v.SetDual(Dual);
+
+	g2v.SetInterleave(Layout == "interleaved");
+
+	g2v.SetConvergence(Convergence);
+
+	g2v.SetCheckerboard(Order == "checkerboard");
+
+	if (!Scratch.empty())
+		g2v.SetScratch(Scratch);
+
+	if (!Checkpoint.empty())
+		g2v.SetCheckpoint(Checkpoint, Resume);
+	else if (Resume)
+	{
+		std::fprintf(stderr,"You must specify a checkpoint file to resume from.\n\n");
+		std::exit(1);
+	}
+
+	std::vector<Gray2Vec_Step> Steps;
+
+	Gray2Vec_Grid::StandardSchedule(Steps, MaxError, Rounds);
+
+	if (!Tiles.empty())
+	{
+		// all tiles are written to the same layer which is only opened once,
+		// memory allocated for processing is reused for the following tiles
+		GDALDatasetH hDS = Gray2Vec_Grid::OpenOutput(file_o, Append);
+
+		if (hDS == NULL)
+			std::exit(1);
+
+		for (size_t i = 0; i < Tiles.size(); i++)
+		{
+			std::fprintf(stderr,"Processing tile %d/%d/%d (%zu of %zu)...\n", Tiles[i].x, Tiles[i].y, Tiles[i].z, i+1, Tiles.size());
+
+			if (i > 0)
+				g2v.Open(Tiles[i].file, Tiles[i].file_c);
+
+			g2v.SetAttributes(Tiles[i].x, Tiles[i].y, Tiles[i].z);
+
+			g2v.Process(Steps);
+
+			if (!g2v.Vectorize(hDS, Layer))
+			{
+				Gray2Vec_Grid::CloseOutput(hDS);
+				std::exit(1);
+			}
+		}
+
+		Gray2Vec_Grid::CloseOutput(hDS);
+
+		return 0;
+	}
+
+	if (Dual)
+	{
+		// the complement reuses the input data and is written to the same vector file
+		GDALDatasetH hDS = Gray2Vec_Grid::OpenOutput(file_o, Append);
+
+		if (hDS == NULL)
+			std::exit(1);
+
+		g2v.Process(Steps);
+
+		bool Res = g2v.Vectorize(hDS, Layer);
+
+		if (Res)
+		{
+			g2v.Complement();
+			g2v.Process(Steps);
+			Res = g2v.Vectorize(hDS, Layer + "_complement");
+		}
+
+		Gray2Vec_Grid::CloseOutput(hDS);
+
+		if (!Res)
+			std::exit(1);
+
+		return 0;
+	}
+
+	if (Bands.empty() && StackList.empty())
+	{
+		g2v.Process(Steps);
+
+		if (!g2v.Vectorize(file_o, Layer, Append))
+			std::exit(1);
+
+		// the checkpoint is not needed any more after success
+		if (!Checkpoint.empty())
+			VSIUnlink(Checkpoint.c_str());
+
+		return 0;
+	}
+
+	std::vector<int> BandList;
+
+	if (!StackList.empty())
+	{
+		// stacked inputs are numbered from 1
+		for (size_t i = 0; i < StackList.size(); i++)
+			BandList.push_back(i+1);
+	}
+	else if (Bands == "all")
+	{
+		for (int b = 1; b <= g2v.BandCount(); b++)
+			BandList.push_back(b);
+	}
+	else
+	{
+		const char *p = Bands.c_str();
+		int b, n;
+
+		while (std::sscanf(p, "%d%n", &b, &n) == 1)
+		{
+			BandList.push_back(b);
+			p += n;
+			if (*p != ',') break;
+			p++;
+		}
+
+		if (*p != '\0')
+		{
+			std::fprintf(stderr,"Invalid band specification '%s', expecting 'all' or a comma separated list.\n\n", Bands.c_str());
+			std::exit(1);
+		}
+	}
+
+	// all bands or stacked inputs are written to the same vector file which is only opened once
+	GDALDatasetH hDS = Gray2Vec_Grid::OpenOutput(file_o, Append);
+
+	if (hDS == NULL)
+		std::exit(1);
+
+	for (size_t i = 0; i < BandList.size(); i++)
+	{
+		char Suffix[32];
+		std::snprintf(Suffix, sizeof(Suffix), "_%d", BandList[i]);
+
+		// the combined image data is read only once for all stacked inputs
+		if (StackList.empty())
+			g2v.SelectBand(BandList[i]);
+		else if (i > 0)
+			g2v.Open(StackList[i], file_c);
+
+		if (!Checkpoint.empty())
+			g2v.SetCheckpoint(Checkpoint + Suffix, Resume);
+
+		g2v.Process(Steps);
+
+		if (!g2v.Vectorize(hDS, Layer + Suffix))
+		{
+			Gray2Vec_Grid::CloseOutput(hDS);
+			std::exit(1);
+		}
+	}
+
+	Gray2Vec_Grid::CloseOutput(hDS);
+
+	if (!Checkpoint.empty())
+		for (size_t i = 0; i < BandList.size(); i++)
+		{
+			char Suffix[32];
+			std::snprintf(Suffix, sizeof(Suffix), "_%d", BandList[i]);
+			VSIUnlink((Checkpoint + Suffix).c_str());
+		}
 }
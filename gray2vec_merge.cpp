@@ -0,0 +1,433 @@
+/* ========================================================================
+    File: @(#)gray2vec_merge.cpp
+   ------------------------------------------------------------------------
+    merges the results of gray2vec runs with -shard into one file
+    Copyright (C) 2016 Christoph Hormann <chris_hormann@gmx.de>
+   ------------------------------------------------------------------------
+
+    This file is part of gray2vec
+
+    gray2vec is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    gray2vec is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with gray2vec.  If not, see <http://www.gnu.org/licenses/>.
+
+    Version history:
+
+      0.1: initial public version, November 2016,
+
+   ========================================================================
+ */
+
+const char PROGRAM_TITLE[] = "gray2vec-merge version 0.1";
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <gdal_priv.h>
+#include <ogrsf_frmts.h>
+#include <ogr_api.h>
+
+/// polygon cut at a shard boundary
+struct Fragment
+{
+	OGRGeometryH hGeom;
+	OGREnvelope oEnv;
+	int nShard;
+	/// shard boundaries touched: 1: top, 2: bottom
+	int nSeam;
+	/// the feature the fragment has been read from
+	OGRFeatureH hFeat;
+};
+
+/// orders fragment indices by the start of their x extent
+struct FragmentMinX
+{
+	explicit FragmentMinX(const std::vector<Fragment> &F) : Fragments(F) { };
+
+	bool operator()(const int i, const int j) const { return Fragments[i].oEnv.MinX < Fragments[j].oEnv.MinX; };
+
+	const std::vector<Fragment> &Fragments;
+};
+
+static int find_root(std::vector<int> &Parent, int i)
+{
+	while (Parent[i] != i)
+	{
+		Parent[i] = Parent[Parent[i]];
+		i = Parent[i];
+	}
+	return i;
+}
+
+/// if the intersection of two fragments contains more than isolated points,
+/// i.e. the fragments share a part of the seam line
+static bool shares_segment(OGRGeometryH hInter)
+{
+	switch (wkbFlatten(OGR_G_GetGeometryType(hInter)))
+	{
+		case wkbPoint:
+		case wkbMultiPoint:
+			return false;
+		case wkbGeometryCollection:
+			for (int i = 0; i < OGR_G_GetGeometryCount(hInter); i++)
+				if (shares_segment(OGR_G_GetGeometryRef(hInter, i)))
+					return true;
+			return false;
+		default:
+			return !OGR_G_IsEmpty(hInter);
+	}
+}
+
+/// connect fragment i and j if they share a part of the seam line
+static void connect_fragments(const std::vector<Fragment> &Fragments, std::vector<int> &Parent, const int i, const int j)
+{
+	const Fragment &A = Fragments[i];
+	const Fragment &B = Fragments[j];
+
+	if ((A.oEnv.MaxY < B.oEnv.MinY) || (B.oEnv.MaxY < A.oEnv.MinY)) return;
+
+	if (find_root(Parent, i) == find_root(Parent, j)) return;
+
+	OGRGeometryH hInter = OGR_G_Intersection(A.hGeom, B.hGeom);
+	if (hInter == NULL) return;
+
+	if (shares_segment(hInter))
+		Parent[find_root(Parent, j)] = find_root(Parent, i);
+
+	OGR_G_DestroyGeometry(hInter);
+}
+
+/// write geometry with the attributes of hSrcFeat, multipolygons are split into polygons
+static bool write_feature(OGRLayerH hLayer, OGRFeatureH hSrcFeat, OGRGeometryH hGeom)
+{
+	if (wkbFlatten(OGR_G_GetGeometryType(hGeom)) != wkbPolygon)
+	{
+		for (int i = 0; i < OGR_G_GetGeometryCount(hGeom); i++)
+			if (!write_feature(hLayer, hSrcFeat, OGR_G_GetGeometryRef(hGeom, i)))
+				return false;
+		return true;
+	}
+
+	OGRFeatureH hFeat = OGR_F_Create( OGR_L_GetLayerDefn( hLayer ) );
+
+	OGR_F_SetFrom( hFeat, hSrcFeat, TRUE );
+	OGR_F_SetGeometry( hFeat, hGeom );
+
+	bool Res = true;
+
+	if( OGR_L_CreateFeature( hLayer, hFeat ) != OGRERR_NONE ) Res = false;
+
+	OGR_F_Destroy( hFeat );
+
+	return Res;
+}
+
+int main(int argc,char **argv)
+{
+	std::fprintf(stderr,"%s\n", PROGRAM_TITLE);
+	std::fprintf(stderr,"-------------------------------------------------------\n");
+	std::fprintf(stderr,"Copyright (C) 2016 Christoph Hormann\n");
+	std::fprintf(stderr,"This program comes with ABSOLUTELY NO WARRANTY;\n");
+	std::fprintf(stderr,"This is free software, and you are welcome to redistribute\n");
+	std::fprintf(stderr,"it under certain conditions; see COPYING for details.\n");
+
+	// --- Read command line parameters ---
+
+	std::string file_o;
+	std::string Layer = "polygons";
+	std::vector<std::string> Files;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((std::strcmp(argv[i], "-o") == 0) && (i+1 < argc))
+			file_o = argv[++i];
+		else if ((std::strcmp(argv[i], "-l") == 0) && (i+1 < argc))
+			Layer = argv[++i];
+		else if ((std::strcmp(argv[i], "-h") == 0) || (argv[i][0] == '-'))
+		{
+			std::fprintf(stderr,"Usage: gray2vec-merge -o output [-l layer] shard_file ...\n\n");
+			std::exit(1);
+		}
+		else
+			Files.push_back(argv[i]);
+	}
+
+	if (file_o.empty() || Files.empty())
+	{
+		std::fprintf(stderr,"You must specify output and input files (try '%s -h').\n\n",argv[0]);
+		std::exit(1);
+	}
+
+	GDALAllRegister();
+	OGRRegisterAll();
+
+	CPLSetConfigOption("OGR_SQLITE_SYNCHRONOUS", "OFF");
+
+	std::vector<GDALDatasetH> Inputs;
+	std::vector<Fragment> Fragments;
+
+	const char *pszDriverName = "SQLite";
+	const char *Options[] = { "SPATIALITE=TRUE", "INIT_WITH_EPSG=no", NULL };
+	GDALDriverH hDriver;
+	GDALDatasetH hDS = NULL;
+	OGRLayerH hLayer = NULL;
+	int nWritten = 0;
+
+	for (size_t f = 0; f < Files.size(); f++)
+	{
+		std::fprintf(stderr,"Reading %s...\n", Files[f].c_str());
+
+#if GDAL_VERSION_MAJOR >= 2
+		GDALDatasetH hInDS = GDALOpenEx(Files[f].c_str(), GDAL_OF_VECTOR, NULL, NULL, NULL );
+#else
+		GDALDatasetH hInDS = OGROpen(Files[f].c_str(), FALSE, NULL);
+#endif
+
+		if (hInDS == NULL)
+		{
+			std::fprintf(stderr,"  opening file %s failed.\n\n", Files[f].c_str());
+			std::exit(1);
+		}
+
+		Inputs.push_back(hInDS);
+
+#if GDAL_VERSION_MAJOR >= 2
+		OGRLayerH hInLayer = GDALDatasetGetLayerByName(hInDS, Layer.c_str() );
+#else
+		OGRLayerH hInLayer = OGR_DS_GetLayerByName(hInDS, Layer.c_str() );
+#endif
+
+		if (hInLayer == NULL)
+		{
+			std::fprintf(stderr,"  layer %s not found in %s.\n\n", Layer.c_str(), Files[f].c_str());
+			std::exit(1);
+		}
+
+		OGRFeatureDefnH hInDefn = OGR_L_GetLayerDefn(hInLayer);
+		const int iShard = OGR_FD_GetFieldIndex(hInDefn, "shard");
+		const int iSeam = OGR_FD_GetFieldIndex(hInDefn, "seam");
+
+		if ((iShard < 0) || (iSeam < 0))
+		{
+			std::fprintf(stderr,"  %s has not been generated with -shard.\n\n", Files[f].c_str());
+			std::exit(1);
+		}
+
+		// the output layer gets the fields of the first input except the shard information
+		if (hDS == NULL)
+		{
+			std::fprintf(stderr,"Preparing vector file...\n");
+
+#if GDAL_VERSION_MAJOR >= 2
+			hDriver = GDALGetDriverByName( pszDriverName );
+#else
+			hDriver = OGRGetDriverByName( pszDriverName );
+#endif
+
+			if (hDriver == NULL)
+			{
+				std::fprintf(stderr, "%s driver not available.\n", pszDriverName);
+				std::exit(1);
+			}
+
+#if GDAL_VERSION_MAJOR >= 2
+			hDS = GDALCreate( hDriver, file_o.c_str(), 0, 0, 0, GDT_Unknown, const_cast<char**>(Options));
+#else
+			hDS = OGR_Dr_CreateDataSource( hDriver, file_o.c_str(), const_cast<char**>(Options));
+#endif
+
+			if (hDS == NULL)
+			{
+				std::fprintf(stderr, "Creation of output file failed.\n");
+				std::exit(1);
+			}
+
+#if GDAL_VERSION_MAJOR >= 2
+			hLayer = GDALDatasetCreateLayer(hDS, Layer.c_str(), OGR_L_GetSpatialRef(hInLayer), wkbPolygon, NULL);
+#else
+			hLayer = OGR_DS_CreateLayer(hDS, Layer.c_str(), OGR_L_GetSpatialRef(hInLayer), wkbPolygon, NULL);
+#endif
+
+			if (hLayer == NULL)
+			{
+				std::fprintf(stderr, "Layer creation failed.\n");
+				std::exit(1);
+			}
+
+			for (int i = 0; i < OGR_FD_GetFieldCount(hInDefn); i++)
+			{
+				if ((i == iShard) || (i == iSeam)) continue;
+
+				if( OGR_L_CreateField( hLayer, OGR_FD_GetFieldDefn(hInDefn, i), TRUE ) != OGRERR_NONE )
+				{
+					std::fprintf(stderr, "Creating attribute field failed.\n" );
+					std::exit(1);
+				}
+			}
+		}
+
+		// complete polygons are copied directly, fragments are kept for merging
+		OGRFeatureH hFeat;
+		OGR_L_ResetReading(hInLayer);
+		while ((hFeat = OGR_L_GetNextFeature(hInLayer)) != NULL)
+		{
+			if (OGR_F_GetFieldAsInteger(hFeat, iSeam) == 0)
+			{
+				if (!write_feature(hLayer, hFeat, OGR_F_GetGeometryRef(hFeat)))
+				{
+					std::fprintf(stderr, "Writing feature failed.\n");
+					std::exit(1);
+				}
+				nWritten++;
+				OGR_F_Destroy(hFeat);
+				continue;
+			}
+
+			Fragment F;
+			F.hFeat = hFeat;
+			F.hGeom = OGR_F_GetGeometryRef(hFeat);
+			F.nShard = OGR_F_GetFieldAsInteger(hFeat, iShard);
+			F.nSeam = OGR_F_GetFieldAsInteger(hFeat, iSeam);
+			OGR_G_GetEnvelope(F.hGeom, &F.oEnv);
+			Fragments.push_back(F);
+		}
+	}
+
+	std::fprintf(stderr,"  %d complete polygons, %d fragments\n", nWritten, int(Fragments.size()));
+
+	std::fprintf(stderr,"Merging fragments...\n");
+
+	// fragments at the bottom of shard k are connected to the ones at the top of
+	// shard k+1 if they share a part of the boundary line
+	std::vector<int> Parent(Fragments.size());
+	for (size_t i = 0; i < Fragments.size(); i++)
+		Parent[i] = i;
+
+	int nShards = 0;
+	for (size_t i = 0; i < Fragments.size(); i++)
+		nShards = std::max(nShards, Fragments[i].nShard+1);
+
+	std::vector<std::vector<int> > Bottom(nShards);
+	std::vector<std::vector<int> > Top(nShards);
+
+	for (size_t i = 0; i < Fragments.size(); i++)
+	{
+		if (Fragments[i].nShard < 0) continue;
+		if (Fragments[i].nSeam & 2) Bottom[Fragments[i].nShard].push_back(i);
+		if (Fragments[i].nSeam & 1) Top[Fragments[i].nShard].push_back(i);
+	}
+
+	for (int k = 0; k < nShards; k++)
+	{
+		std::sort(Bottom[k].begin(), Bottom[k].end(), FragmentMinX(Fragments));
+		std::sort(Top[k].begin(), Top[k].end(), FragmentMinX(Fragments));
+	}
+
+	// sweep over the x extents of the fragments at each seam, only those
+	// overlapping in x are tested against each other
+	for (int k = 0; k+1 < nShards; k++)
+	{
+		const std::vector<int> &Upper = Bottom[k];
+		const std::vector<int> &Lower = Top[k+1];
+		std::vector<int> ActiveUpper;
+		std::vector<int> ActiveLower;
+		size_t iu = 0;
+		size_t il = 0;
+
+		while ((iu < Upper.size()) || (il < Lower.size()))
+		{
+			const bool bUpper = (il >= Lower.size()) || ((iu < Upper.size()) && (Fragments[Upper[iu]].oEnv.MinX <= Fragments[Lower[il]].oEnv.MinX));
+			const int i = bUpper ? Upper[iu++] : Lower[il++];
+			const double MinX = Fragments[i].oEnv.MinX;
+
+			std::vector<int> &Other = bUpper ? ActiveLower : ActiveUpper;
+
+			// remove the fragments of the other side ending before this one
+			size_t n = 0;
+			for (size_t a = 0; a < Other.size(); a++)
+				if (Fragments[Other[a]].oEnv.MaxX > MinX)
+					Other[n++] = Other[a];
+			Other.resize(n);
+
+			for (size_t a = 0; a < Other.size(); a++)
+			{
+				if (bUpper)
+					connect_fragments(Fragments, Parent, i, Other[a]);
+				else
+					connect_fragments(Fragments, Parent, Other[a], i);
+			}
+
+			(bUpper ? ActiveUpper : ActiveLower).push_back(i);
+		}
+	}
+
+	// union the connected fragments
+	std::vector<OGRGeometryH> Merged(Fragments.size(), (OGRGeometryH)NULL);
+	std::vector<int> First(Fragments.size(), -1);
+
+	for (size_t i = 0; i < Fragments.size(); i++)
+	{
+		const int r = find_root(Parent, i);
+
+		if (Merged[r] == NULL)
+		{
+			Merged[r] = OGR_G_Clone(Fragments[i].hGeom);
+			First[r] = i;
+		}
+		else
+		{
+			OGRGeometryH hUnion = OGR_G_Union(Merged[r], Fragments[i].hGeom);
+			if (hUnion == NULL)
+			{
+				std::fprintf(stderr, "Merging polygons failed.\n");
+				std::exit(1);
+			}
+			OGR_G_DestroyGeometry(Merged[r]);
+			Merged[r] = hUnion;
+		}
+	}
+
+	int nMerged = 0;
+
+	for (size_t i = 0; i < Fragments.size(); i++)
+	{
+		if (Merged[i] == NULL) continue;
+
+		if (!write_feature(hLayer, Fragments[First[i]].hFeat, Merged[i]))
+		{
+			std::fprintf(stderr, "Writing feature failed.\n");
+			std::exit(1);
+		}
+
+		OGR_G_DestroyGeometry(Merged[i]);
+		nMerged++;
+	}
+
+	std::fprintf(stderr,"  %d polygons from fragments\n", nMerged);
+
+	for (size_t i = 0; i < Fragments.size(); i++)
+		OGR_F_Destroy(Fragments[i].hFeat);
+
+#if GDAL_VERSION_MAJOR >= 2
+	GDALClose(hDS);
+	for (size_t f = 0; f < Inputs.size(); f++)
+		GDALClose(Inputs[f]);
+#else
+	OGR_DS_Destroy(hDS);
+	for (size_t f = 0; f < Inputs.size(); f++)
+		OGR_DS_Destroy(Inputs[f]);
+#endif
+}